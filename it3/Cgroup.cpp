@@ -0,0 +1,98 @@
+#include "Cgroup.h"
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Parses /sys/devices/system/cpu/online, a list like "0-3,6"
+std::vector<int> online_cpus() {
+    std::vector<int> cpus;
+    std::ifstream file("/sys/devices/system/cpu/online");
+    std::string list;
+    if (!std::getline(file, list)) {
+        for (int cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN); ++cpu) {
+            cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+
+    std::istringstream ranges(list);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+CgroupMonitor::CgroupMonitor(const std::string &path, const std::string &count_event, const std::string &record_event,
+                             uint64_t sample_period, uint64_t sample_type)
+    : path(path[0] == '/' ? path : CGROUP_ROOT + path) {
+    cgroup_fd = open(this->path.c_str(), O_RDONLY | O_DIRECTORY);
+    if (cgroup_fd == -1) {
+        error_and_exit("open " + this->path);
+    }
+
+    if (sample_type & PERF_SAMPLE_ADDR) {
+        memory = std::make_unique<MemTracker>();
+        profile.memory = memory.get();
+    }
+
+    for (int cpu : online_cpus()) {
+        if (!count_event.empty()) {
+            counting_events.push_back(PerfEvent::cgroup(count_event, false, cgroup_fd, cpu));
+        }
+        if (!record_event.empty()) {
+            auto event = PerfEvent::cgroup(record_event, true, cgroup_fd, cpu, sample_period, sample_type);
+            if (event->fd != -1) {
+                int fd = event->fd;
+                sampling_events[fd] = std::move(event);
+            }
+        }
+    }
+
+    // Processes already running in the cgroup made their mappings before the events were opened,
+    // processes that join later are read on the first sample that misses
+    if (!record_event.empty()) {
+        profile.proc_maps = true;
+        std::ifstream procs(this->path + "/cgroup.procs");
+        uint32_t pid;
+        while (procs >> pid) {
+            read_proc_maps(pid, profile);
+        }
+    }
+}
+
+CgroupMonitor::~CgroupMonitor() {
+    sampling_events.clear();
+    counting_events.clear();
+    close(cgroup_fd);
+}
+
+// Moves the process into the cgroup, e.g. a command started by perf_monitor
+void CgroupMonitor::add_process(pid_t pid) {
+    std::ofstream procs(path + "/cgroup.procs");
+    procs << pid << std::endl;
+    if (!procs) {
+        error_and_exit("write " + path + "/cgroup.procs");
+    }
+}
+
+void CgroupMonitor::drain() {
+    for (auto &pair : sampling_events) {
+        pair.second->read_samples(sampling_events, profile);
+    }
+}
+
+// Sum of the per-CPU counters
+uint64_t CgroupMonitor::read_count() {
+    uint64_t count = 0;
+    for (auto &event : counting_events) {
+        count += event->read_value();
+    }
+    return count;
+}
@@ -0,0 +1,42 @@
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include "PerfEvent.h"
+#include "Profile.h"
+#include "Memory.h"
+
+#define CGROUP_ROOT "/sys/fs/cgroup/"
+
+// Profiling of a whole container: one event per CPU opened with
+// PERF_FLAG_PID_CGROUP on the cgroup v2 directory, so every process of the
+// cgroup is covered without following forks.
+class CgroupMonitor {
+public:
+    std::string path;
+    ProfileData profile;
+    EventMap sampling_events;                                // By fd, one per CPU
+    std::vector<std::unique_ptr<PerfEvent>> counting_events; // One per CPU
+    std::unique_ptr<MemTracker> memory;                      // When sampling data addresses
+
+    // Relative paths are taken from CGROUP_ROOT, empty event names are not opened
+    CgroupMonitor(const std::string &path, const std::string &count_event, const std::string &record_event,
+                  uint64_t sample_period, uint64_t sample_type);
+    ~CgroupMonitor();
+
+    CgroupMonitor(const CgroupMonitor &) = delete;
+    CgroupMonitor &operator=(const CgroupMonitor &) = delete;
+
+    void add_process(pid_t pid);
+    void drain();
+    uint64_t read_count();
+
+private:
+    int cgroup_fd;
+};
+
+std::vector<int> online_cpus();
+
+#endif // CGROUP_H
@@ -0,0 +1,203 @@
+#include "Export.h"
+#include "utils.h"
+
+// profile.proto field numbers
+#define PROFILE_SAMPLE_TYPE 1
+#define PROFILE_SAMPLE 2
+#define PROFILE_MAPPING 3
+#define PROFILE_LOCATION 4
+#define PROFILE_STRING_TABLE 6
+#define PROFILE_PERIOD_TYPE 11
+#define PROFILE_PERIOD 12
+
+#define WIRE_VARINT 0
+#define WIRE_LENGTH_DELIMITED 2
+
+static void put_varint(std::string &buffer, uint64_t value) {
+    while (value >= 0x80) {
+        buffer.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back((char)value);
+}
+
+static void put_tag(std::string &buffer, int field, int wire_type) {
+    put_varint(buffer, (uint64_t)field << 3 | wire_type);
+}
+
+static void put_uint(std::string &buffer, int field, uint64_t value) {
+    put_tag(buffer, field, WIRE_VARINT);
+    put_varint(buffer, value);
+}
+
+static void put_bytes(std::string &buffer, int field, const std::string &bytes) {
+    put_tag(buffer, field, WIRE_LENGTH_DELIMITED);
+    put_varint(buffer, bytes.size());
+    buffer += bytes;
+}
+
+static std::string value_type(int64_t type, int64_t unit) {
+    std::string message;
+    put_uint(message, 1, type);
+    put_uint(message, 2, unit);
+    return message;
+}
+
+PprofWriter::PprofWriter(const std::string &path, const std::string &event_name, uint64_t sample_period)
+    : out(path, std::ios::binary), sample_period(sample_period), event_values(!event_name.empty()) {
+    if (!out) {
+        error_and_exit("open " + path);
+    }
+
+    // string_table[0] must be the empty string
+    string_index("");
+
+    write_field(PROFILE_SAMPLE_TYPE, value_type(string_index("samples"), string_index("count")));
+    if (!event_values) {
+        return;
+    }
+
+    std::string unit = (event_name == "cpu-clock" || event_name == "task-clock") ? "nanoseconds" : "count";
+    write_field(PROFILE_SAMPLE_TYPE, value_type(string_index(event_name), string_index(unit)));
+    write_field(PROFILE_PERIOD_TYPE, value_type(string_index(event_name), string_index(unit)));
+
+    std::string period;
+    put_uint(period, PROFILE_PERIOD, sample_period);
+    out.write(period.data(), period.size());
+}
+
+PprofWriter::~PprofWriter() {
+    out.close();
+}
+
+void PprofWriter::write_field(int field, const std::string &message) {
+    std::string header;
+    put_tag(header, field, WIRE_LENGTH_DELIMITED);
+    put_varint(header, message.size());
+    out.write(header.data(), header.size());
+    out.write(message.data(), message.size());
+}
+
+int64_t PprofWriter::string_index(const std::string &value) {
+    auto it = strings.find(value);
+    if (it != strings.end()) {
+        return it->second;
+    }
+
+    int64_t index = strings.size();
+    strings[value] = index;
+    write_field(PROFILE_STRING_TABLE, value);
+    return index;
+}
+
+void PprofWriter::add_mapping(uint64_t start, uint64_t limit, uint64_t file_offset, const std::string &filename) {
+    // A file range mapped again at the same address keeps its mapping id
+    int64_t name = string_index(filename);
+    auto it = mappings.find(start);
+    if (it != mappings.end() && it->second.limit == limit && it->second.file_offset == file_offset &&
+        it->second.filename == name) {
+        return;
+    }
+
+    // Ids stay unique when a new mapping replaces an old one at the same start
+    uint64_t id = next_mapping_id++;
+    mappings[start] = {limit, file_offset, name, id};
+
+    std::string message;
+    put_uint(message, 1, id);
+    put_uint(message, 2, start);
+    put_uint(message, 3, limit);
+    put_uint(message, 4, file_offset);
+    put_uint(message, 5, name);
+    write_field(PROFILE_MAPPING, message);
+}
+
+uint64_t PprofWriter::location_id(uint64_t address) {
+    auto it = locations.find(address);
+    if (it != locations.end()) {
+        return it->second;
+    }
+
+    uint64_t id = locations.size() + 1;
+    locations[address] = id;
+
+    std::string message;
+    put_uint(message, 1, id);
+    auto mapping = mappings.upper_bound(address);
+    if (mapping != mappings.begin() && address < std::prev(mapping)->second.limit) {
+        put_uint(message, 2, std::prev(mapping)->second.id);
+    }
+    put_uint(message, 3, address);
+    write_field(PROFILE_LOCATION, message);
+    return id;
+}
+
+void PprofWriter::add_sample(const std::vector<uint64_t> &stack, int64_t samples) {
+    // Locations first, the sample refers to them by id
+    std::string ids;
+    for (uint64_t address : stack) {
+        put_varint(ids, location_id(address));
+    }
+
+    std::string values;
+    put_varint(values, samples);
+    if (event_values) {
+        put_varint(values, samples * sample_period);
+    }
+
+    std::string message;
+    put_bytes(message, 1, ids);    // Packed location_id
+    put_bytes(message, 2, values); // Packed value
+    write_field(PROFILE_SAMPLE, message);
+}
+
+static std::string json_escape(const std::string &value) {
+    std::string escaped;
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if ((unsigned char)c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+ChromeTraceWriter::ChromeTraceWriter(const std::string &path) : out(path) {
+    if (!out) {
+        error_and_exit("open " + path);
+    }
+    out << "[\n";
+}
+
+ChromeTraceWriter::~ChromeTraceWriter() {
+    out << "\n]\n";
+}
+
+void ChromeTraceWriter::begin_event() {
+    if (!first) {
+        out << ",\n";
+    }
+    first = false;
+}
+
+// Trace Event timestamps are microseconds
+void ChromeTraceWriter::sample(uint32_t pid, uint32_t tid, uint64_t time_ns, const std::string &name, uint64_t ip) {
+    begin_event();
+    char address[32];
+    snprintf(address, sizeof(address), "0x%llx", (unsigned long long)ip);
+    out << "{\"name\":\"" << json_escape(name) << "\",\"cat\":\"sample\",\"ph\":\"i\",\"s\":\"t\",\"ts\":"
+        << time_ns / 1000 << "." << (time_ns % 1000) / 100 << ",\"pid\":" << pid << ",\"tid\":" << tid
+        << ",\"args\":{\"ip\":\"" << address << "\"}}";
+}
+
+void ChromeTraceWriter::region(uint32_t pid, uint32_t tid, uint64_t time_ns, const std::string &name, bool enter) {
+    begin_event();
+    out << "{\"name\":\"" << json_escape(name) << "\",\"cat\":\"region\",\"ph\":\"" << (enter ? "B" : "E") << "\",\"ts\":"
+        << time_ns / 1000 << "." << (time_ns % 1000) / 100 << ",\"pid\":" << pid << ",\"tid\":" << tid << "}";
+}
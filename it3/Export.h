@@ -0,0 +1,63 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <string>
+#include <fstream>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+
+// Writes a profile.proto message (the pprof format) without a protobuf
+// dependency. A Profile is a plain sequence of fields and repeated fields may
+// be interleaved, so every mapping, location, string and sample is written as
+// soon as it is known. Memory use is bounded by the number of distinct
+// addresses and strings, not by the number of samples.
+class PprofWriter {
+public:
+    // An empty event_name writes only the sample count, for samples of an unknown event
+    PprofWriter(const std::string &path, const std::string &event_name, uint64_t sample_period);
+    ~PprofWriter();
+
+    void add_mapping(uint64_t start, uint64_t limit, uint64_t file_offset, const std::string &filename);
+    // Callchain innermost frame first, value is the number of samples
+    void add_sample(const std::vector<uint64_t> &stack, int64_t samples);
+
+private:
+    std::ofstream out;
+    uint64_t sample_period;
+    bool event_values; // Samples carry an event value next to the count
+    std::unordered_map<std::string, int64_t> strings;
+    std::unordered_map<uint64_t, uint64_t> locations; // Address -> location id
+    struct Mapping {
+        uint64_t limit;
+        uint64_t file_offset;
+        int64_t filename;
+        uint64_t id;
+    };
+    std::map<uint64_t, Mapping> mappings; // By start address
+    uint64_t next_mapping_id = 1;
+
+    int64_t string_index(const std::string &value);
+    uint64_t location_id(uint64_t address);
+    void write_field(int field, const std::string &message);
+};
+
+// Streams Chrome Trace Event Format (JSON array) events while profiling,
+// viewable in chrome://tracing and Perfetto. Nothing is kept in memory.
+class ChromeTraceWriter {
+public:
+    explicit ChromeTraceWriter(const std::string &path);
+    ~ChromeTraceWriter();
+
+    void sample(uint32_t pid, uint32_t tid, uint64_t time_ns, const std::string &name, uint64_t ip);
+    void region(uint32_t pid, uint32_t tid, uint64_t time_ns, const std::string &name, bool enter);
+
+private:
+    std::ofstream out;
+    bool first = true;
+
+    void begin_event();
+};
+
+#endif // EXPORT_H
@@ -0,0 +1,197 @@
+#include "FlightRecorder.h"
+#include "Cgroup.h"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <time.h>
+
+// Sample rate assumed for events that are not time based
+#define FLIGHT_DEFAULT_RATE 10000.0
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Enough 2^n data pages for `seconds` of samples on a busy CPU, with room for MMAP and COMM records
+static size_t buffer_size_for(const std::string &event_name, uint64_t sample_period, uint64_t sample_type, double seconds) {
+    double rate = FLIGHT_DEFAULT_RATE;
+    if (event_name == "cpu-clock" || event_name == "task-clock") {
+        rate = 1e9 / sample_period;
+    }
+    double record_size = sizeof(struct perf_event_header) + 8 * __builtin_popcountll(sample_type);
+    if (sample_type & PERF_SAMPLE_CALLCHAIN) {
+        record_size += 8 * 32;
+    }
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    double wanted = 2 * seconds * rate * record_size;
+    size_t pages = 16;
+    while (pages < FLIGHT_MAX_DATA_PAGES && pages * page_size < wanted) {
+        pages *= 2;
+    }
+    return (pages + 1) * page_size;
+}
+
+FlightRecorder::FlightRecorder(const std::string &event_name, pid_t pid, uint64_t sample_period, uint64_t sample_type,
+                               double seconds, const std::string &prefix)
+    : seconds(seconds), prefix(prefix), start(std::chrono::steady_clock::now()) {
+    size_t buffer_size = buffer_size_for(event_name, sample_period, sample_type, seconds);
+    for (int cpu : online_cpus()) {
+        auto event = PerfEvent::flight_recorder(event_name, pid, cpu, sample_period, sample_type, buffer_size);
+        if (event->fd != -1) {
+            events.push_back(std::move(event));
+        }
+    }
+    if (events.empty()) {
+        std::cerr << "No flight recorder buffer could be opened.\n";
+        exit(EXIT_FAILURE);
+    }
+
+    sideband.flight = this;
+    for (int cpu : online_cpus()) {
+        auto event = PerfEvent::sideband(pid, cpu, FLIGHT_SIDEBAND_BUFFER_SIZE);
+        if (event->fd != -1) {
+            int fd = event->fd;
+            sideband_events[fd] = std::move(event);
+        }
+    }
+
+    std::cout << "Flight recorder: " << events.size() << " CPU buffers of " << (buffer_size - sysconf(_SC_PAGESIZE)) / 1024
+              << " KB, keeping the last " << seconds << " s\n";
+}
+
+void FlightRecorder::set_timeout(double timeout_seconds) {
+    timeout = timeout_seconds;
+}
+
+bool FlightRecorder::parse_threshold(const std::string &condition, std::string &name, double &limit) {
+    size_t greater = condition.find('>');
+    if (greater == std::string::npos || greater == 0) {
+        return false;
+    }
+    try {
+        size_t used;
+        limit = std::stod(condition.substr(greater + 1), &used);
+        if (greater + 1 + used != condition.size()) {
+            return false;
+        }
+    } catch (const std::exception &) {
+        return false;
+    }
+    name = condition.substr(0, greater);
+    return true;
+}
+
+void FlightRecorder::set_threshold(const std::string &name, double limit) {
+    threshold_name = name;
+    threshold_limit = limit;
+}
+
+void FlightRecorder::drain_sideband() {
+    for (auto &pair : sideband_events) {
+        pair.second->read_samples(sideband_events, sideband);
+    }
+    if (sideband.lost > sideband_lost) {
+        std::cerr << "Flight recorder: " << sideband.lost - sideband_lost
+                  << " sideband records lost, snapshots may miss mappings.\n";
+        sideband_lost = sideband.lost;
+    }
+
+    // Tasks that exited before the window of a snapshot taken now have no samples left in it
+    uint64_t now = monotonic_ns();
+    uint64_t window_start = now - std::min<uint64_t>(now, seconds * 1e9);
+    while (!exited.empty() && exited.front().time < window_start) {
+        const ExitedTask &task = exited.front();
+        if (task.pid == task.tid) {
+            sideband.mmap_records.erase(task.pid);
+        }
+        comms.erase(task.tid);
+        exited.pop_front();
+    }
+}
+
+void FlightRecorder::add_poll_fds(std::vector<struct pollfd> &poll_fds) const {
+    for (const auto &pair : sideband_events) {
+        poll_fds.push_back({pair.first, POLLIN, 0});
+    }
+}
+
+void FlightRecorder::on_comm(const StreamComm &comm) {
+    comms[comm.tid] = comm;
+}
+
+void FlightRecorder::on_exit(uint32_t pid, uint32_t tid) {
+    exited.push_back({monotonic_ns(), pid, tid});
+}
+
+void FlightRecorder::check_timeout() {
+    if (timeout <= 0 || timeout_done) {
+        return;
+    }
+    if (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() >= timeout) {
+        timeout_done = true;
+        snapshot("timeout");
+    }
+}
+
+// Snapshots when the value goes over the limit, not again until it has come back under
+void FlightRecorder::on_interval(const IntervalRecorder &interval) {
+    double value;
+    if (threshold_name.empty() || !interval.value(threshold_name, value)) {
+        return;
+    }
+    bool above = value > threshold_limit;
+    if (above && !above_threshold) {
+        std::ostringstream reason;
+        reason << threshold_name << " " << value << " > " << threshold_limit;
+        snapshot(reason.str());
+    }
+    above_threshold = above;
+}
+
+void FlightRecorder::snapshot(const std::string &reason) {
+    uint64_t now = monotonic_ns();
+    std::vector<StreamSample> samples;
+    for (auto &event : events) {
+        event->read_snapshot(samples);
+    }
+
+    // Oldest first, so that time deltas in the stream stay small and positive
+    std::sort(samples.begin(), samples.end(), [](const StreamSample &a, const StreamSample &b) { return a.time < b.time; });
+    uint64_t window_start = now - std::min<uint64_t>(now, seconds * 1e9);
+    auto first = std::lower_bound(samples.begin(), samples.end(), window_start,
+                                  [](const StreamSample &sample, uint64_t time) { return sample.time < time; });
+
+    std::string path = prefix + "." + std::to_string(++snapshots) + ".stream";
+    SampleEncoder encoder(path);
+
+    // Mappings and names of the processes that can have samples in the window, ahead of the samples
+    drain_sideband();
+    for (const auto &[pid, records] : sideband.mmap_records) {
+        for (const auto &[start, record] : records) {
+            encoder.add_mmap({pid, start, record.end - start, record.pgoff, "", record.filename});
+        }
+    }
+    for (const auto &[tid, comm] : comms) {
+        encoder.add_comm(comm);
+    }
+
+    for (auto it = first; it != samples.end(); ++it) {
+        encoder.add(it->pid, it->tid, it->time, it->ip, it->callchain, 0);
+    }
+    encoder.flush();
+
+    std::streamsize precision = std::cout.precision();
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "Flight snapshot " << snapshots << " (" << reason << "): " << encoder.samples << " samples";
+    if (encoder.samples) {
+        // A buffer too small for the window holds less than the requested seconds
+        std::cout << " covering " << (now - first->time) / 1e9 << " s";
+    }
+    std::cout << ", " << encoder.bytes() << " bytes written to " << path << "\n";
+    std::cout.unsetf(std::ios::fixed);
+    std::cout.precision(precision);
+}
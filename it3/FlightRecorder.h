@@ -0,0 +1,79 @@
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <deque>
+#include <poll.h>
+#include "PerfEvent.h"
+#include "Profile.h"
+#include "SampleStream.h"
+#include "Interval.h"
+
+// Largest per-CPU buffer, 2^n data pages
+#define FLIGHT_MAX_DATA_PAGES 16384
+// Per-CPU sideband buffer, for the MMAP, COMM and task records between two drains
+#define FLIGHT_SIDEBAND_BUFFER_SIZE ((1 + 64) * 4096)
+
+// Flight recorder mode: one overwrite (write_backward) buffer per CPU keeps
+// the most recent samples of the task and its children at no cost to
+// perf_monitor. Only a trigger reads them: SIGUSR2, a timeout, or an
+// interval counter crossing a threshold. Each snapshot keeps the samples of
+// the last `seconds` and is written as a compact sample stream to
+// <prefix>.<n>.stream. The MMAP and COMM records would be overwritten with
+// the samples, so a per-CPU dummy event tracks the mappings and names of the
+// live processes, which every snapshot starts with, to be symbolized after
+// the target has exited. Those of an exited process are kept for as long as
+// its samples can be in a snapshot.
+class FlightRecorder {
+public:
+    int snapshots = 0;
+
+    FlightRecorder(const std::string &event_name, pid_t pid, uint64_t sample_period, uint64_t sample_type,
+                   double seconds, const std::string &prefix);
+
+    FlightRecorder(const FlightRecorder &) = delete;
+    FlightRecorder &operator=(const FlightRecorder &) = delete;
+
+    // "name>limit" with an interval event or ipc / cache_miss_rate, false if malformed
+    static bool parse_threshold(const std::string &condition, std::string &name, double &limit);
+
+    // One snapshot once the recorder has run this long
+    void set_timeout(double timeout_seconds);
+    void set_threshold(const std::string &name, double limit);
+    bool has_threshold() const { return !threshold_name.empty(); }
+
+    void drain_sideband(); // Called on every wakeup of the event loop
+    void add_poll_fds(std::vector<struct pollfd> &poll_fds) const; // Sideband buffers, readable when half full
+    // From the sideband records
+    void on_comm(const StreamComm &comm);
+    void on_exit(uint32_t pid, uint32_t tid);
+    void check_timeout();
+    void on_interval(const IntervalRecorder &interval); // After every interval, snapshots when the threshold is crossed
+    void snapshot(const std::string &reason);
+
+private:
+    std::vector<std::unique_ptr<PerfEvent>> events; // One per CPU
+    struct ExitedTask {
+        uint64_t time; // CLOCK_MONOTONIC when the EXIT record was read
+        uint32_t pid, tid;
+    };
+
+    EventMap sideband_events;                       // One per CPU
+    ProfileData sideband;                           // Code mappings by pid
+    std::unordered_map<uint32_t, StreamComm> comms; // Latest name by tid
+    std::deque<ExitedTask> exited;                  // Oldest first
+    uint64_t sideband_lost = 0;                     // Lost records already warned about
+    double seconds;
+    std::string prefix;
+    std::chrono::steady_clock::time_point start;
+    double timeout = 0;
+    bool timeout_done = false;
+    std::string threshold_name;
+    double threshold_limit = 0;
+    bool above_threshold = false;
+};
+
+#endif // FLIGHT_RECORDER_H
@@ -0,0 +1,258 @@
+#include "Interval.h"
+#include "PerfEvent.h"
+#include <iostream>
+#include <iomanip>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+CounterGroup::CounterGroup(const std::vector<std::string> &event_names, pid_t pid) {
+    for (const auto &event_name : event_names) {
+        struct perf_event_attr pe;
+        memset(&pe, 0, sizeof(struct perf_event_attr));
+        pe.size = sizeof(struct perf_event_attr);
+        if (!lookup_event(event_name, pe)) {
+            std::cerr << "Unsupported event type " << event_name << ".\n";
+            exit(EXIT_FAILURE);
+        }
+        pe.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        pe.disabled = leader_fd == -1; // Members follow the leader
+        pe.exclude_kernel = 1;
+        pe.exclude_hv = 1;
+
+        int fd = perf_event_open(&pe, pid, -1, leader_fd, 0);
+        if (fd == -1) {
+            if (errno == ESRCH) {
+                error_and_exit("perf_event_open");
+            }
+            std::cerr << "Event " << event_name << " is not available, left out of the interval group.\n";
+            continue;
+        }
+        if (leader_fd == -1) {
+            leader_fd = fd;
+        }
+        fds.push_back(fd);
+        names.push_back(event_name);
+    }
+
+    if (leader_fd == -1) {
+        std::cerr << "No interval event could be opened.\n";
+        exit(EXIT_FAILURE);
+    }
+}
+
+CounterGroup::~CounterGroup() {
+    for (int fd : fds) {
+        close(fd);
+    }
+}
+
+void CounterGroup::enable() {
+    ioctl(leader_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+bool CounterGroup::read_values(std::vector<uint64_t> &values, uint64_t &time_enabled, uint64_t &time_running) {
+    // { nr, time_enabled, time_running, value[nr] }
+    std::vector<uint64_t> buffer(3 + fds.size());
+    ssize_t size = read(leader_fd, buffer.data(), buffer.size() * sizeof(uint64_t));
+    if (size < (ssize_t)(3 * sizeof(uint64_t))) {
+        return false;
+    }
+
+    uint64_t nr = buffer[0];
+    time_enabled = buffer[1];
+    time_running = buffer[2];
+    values.assign(names.size(), 0);
+    for (uint64_t i = 0; i < nr && i < values.size(); ++i) {
+        values[i] = buffer[3 + i];
+    }
+    return true;
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+IntervalRecorder::IntervalRecorder(CounterGroup &group, uint64_t interval_ms, const std::string &path)
+    : group(group), interval_ms(interval_ms), out(&std::cout) {
+    binary = path.size() > 4 && path.compare(path.size() - 4, 4, ".bin") == 0;
+    if (!path.empty()) {
+        file.open(path, binary ? std::ios::binary : std::ios::out);
+        if (!file) {
+            error_and_exit("open " + path);
+        }
+        out = &file;
+    }
+
+    cycles = event_index("cycles");
+    instructions = event_index("instructions");
+    cache_references = event_index("cache-references");
+    cache_misses = event_index("cache-misses");
+    if (cycles != -1 && instructions != -1) {
+        derived_names.push_back("ipc");
+    }
+    if (cache_references != -1 && cache_misses != -1) {
+        derived_names.push_back("cache_miss_rate");
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        error_and_exit("timerfd_create");
+    }
+
+    // Header: the column names, or magic, interval and the length-prefixed event and derived names
+    if (binary) {
+        uint64_t magic = INTERVAL_BINARY_MAGIC;
+        out->write((const char *)&magic, sizeof(magic));
+        out->write((const char *)&interval_ms, sizeof(interval_ms));
+        for (const auto *names : {&group.names, &derived_names}) {
+            uint32_t count = names->size();
+            out->write((const char *)&count, sizeof(count));
+            for (const auto &name : *names) {
+                uint16_t length = name.size();
+                out->write((const char *)&length, sizeof(length));
+                out->write(name.data(), length);
+            }
+        }
+    } else {
+        *out << "time_ms";
+        for (const auto &name : group.names) {
+            *out << "," << name;
+        }
+        for (const auto &name : derived_names) {
+            *out << "," << name;
+        }
+        *out << "\n";
+    }
+}
+
+IntervalRecorder::~IntervalRecorder() {
+    if (timer_fd != -1) {
+        close(timer_fd);
+    }
+}
+
+int IntervalRecorder::event_index(const std::string &name) const {
+    for (size_t i = 0; i < group.names.size(); ++i) {
+        if (group.names[i] == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// ipc and cache_miss_rate of the last interval, in the order of derived_names
+std::vector<double> IntervalRecorder::derived() const {
+    std::vector<double> values;
+    if (cycles != -1 && instructions != -1) {
+        values.push_back(deltas[cycles] ? (double)deltas[instructions] / deltas[cycles] : 0.0);
+    }
+    if (cache_references != -1 && cache_misses != -1) {
+        values.push_back(deltas[cache_references] ? (double)deltas[cache_misses] / deltas[cache_references] : 0.0);
+    }
+    return values;
+}
+
+bool IntervalRecorder::value(const std::string &name, double &value) const {
+    if (deltas.empty()) {
+        return false;
+    }
+    std::vector<double> values = derived();
+    for (size_t i = 0; i < derived_names.size(); ++i) {
+        if (derived_names[i] == name) {
+            value = values[i];
+            return true;
+        }
+    }
+    int index = event_index(name);
+    if (index == -1) {
+        return false;
+    }
+    value = deltas[index];
+    return true;
+}
+
+bool IntervalRecorder::total(const std::string &name, uint64_t &total) const {
+    int index = event_index(name);
+    if (index == -1 || totals.empty()) {
+        return false;
+    }
+    total = totals[index];
+    return true;
+}
+
+void IntervalRecorder::start() {
+    group.enable();
+    start_ns = monotonic_ns();
+    previous.assign(group.names.size(), 0);
+    previous_enabled = previous_running = 0;
+    totals.assign(group.names.size(), 0);
+
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = interval_ms / 1000;
+    spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(timer_fd, 0, &spec, nullptr) == -1) {
+        error_and_exit("timerfd_settime");
+    }
+}
+
+void IntervalRecorder::on_timer() {
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    emit(monotonic_ns());
+}
+
+void IntervalRecorder::finish() {
+    struct itimerspec spec = {};
+    timerfd_settime(timer_fd, 0, &spec, nullptr);
+    emit(monotonic_ns());
+    out->flush();
+}
+
+void IntervalRecorder::emit(uint64_t now_ns) {
+    std::vector<uint64_t> values;
+    uint64_t enabled, running;
+    if (!group.read_values(values, enabled, running)) {
+        return; // The task is gone
+    }
+
+    // Raw counts only grow, the share of the interval the group was on the PMU scales them
+    uint64_t enabled_delta = enabled - previous_enabled;
+    uint64_t running_delta = running - previous_running;
+    deltas.resize(values.size());
+    for (size_t i = 0; i < values.size(); ++i) {
+        uint64_t delta = values[i] - previous[i];
+        if (running_delta < enabled_delta) {
+            delta = running_delta ? (uint64_t)((double)delta * enabled_delta / running_delta) : 0;
+        }
+        deltas[i] = delta;
+        totals[i] += delta;
+    }
+    previous = values;
+    previous_enabled = enabled;
+    previous_running = running;
+
+    uint64_t elapsed_ns = now_ns - start_ns;
+    std::vector<double> derived_values = derived();
+    if (binary) {
+        out->write((const char *)&elapsed_ns, sizeof(elapsed_ns));
+        out->write((const char *)deltas.data(), deltas.size() * sizeof(uint64_t));
+        out->write((const char *)derived_values.data(), derived_values.size() * sizeof(double));
+        return;
+    }
+
+    *out << elapsed_ns / 1000000 << "." << std::setw(3) << std::setfill('0') << (elapsed_ns / 1000) % 1000 << std::setfill(' ');
+    for (uint64_t delta : deltas) {
+        *out << "," << delta;
+    }
+    for (double value : derived_values) {
+        *out << "," << value;
+    }
+    *out << "\n";
+}
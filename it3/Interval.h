@@ -0,0 +1,82 @@
+#ifndef INTERVAL_H
+#define INTERVAL_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+#include <sys/types.h>
+
+#define INTERVAL_BINARY_MAGIC 0x3276726e69666570ULL // "pefinrv2"
+
+// Counters read together with one read() of a PERF_FORMAT_GROUP leader.
+// Events the machine does not support are left out of the group.
+class CounterGroup {
+public:
+    std::vector<std::string> names; // Opened events, the leader first
+    int leader_fd = -1;
+
+    CounterGroup(const std::vector<std::string> &event_names, pid_t pid);
+    ~CounterGroup();
+
+    CounterGroup(const CounterGroup &) = delete;
+    CounterGroup &operator=(const CounterGroup &) = delete;
+
+    void enable();
+    // Raw cumulative counts, with the times the group was enabled and running on the PMU
+    bool read_values(std::vector<uint64_t> &values, uint64_t &time_enabled, uint64_t &time_running);
+
+private:
+    std::vector<int> fds;
+};
+
+// Interval counter mode: reads the group every interval_ms from a timerfd in
+// the event loop and writes per-interval deltas with derived IPC and cache
+// miss rate, as CSV or as binary records (path ending in .bin). When the PMU
+// multiplexes the group, each delta is scaled by the enabled / running time
+// of its own interval, since scaled cumulative values need not grow.
+//
+// Binary layout, little endian: magic, interval_ms (u64), event count (u32)
+// and u16 length-prefixed names, derived count (u32) and names; then per
+// interval the elapsed ns (u64), the deltas (u64) and the derived values (double).
+class IntervalRecorder {
+public:
+    int timer_fd = -1;
+
+    IntervalRecorder(CounterGroup &group, uint64_t interval_ms, const std::string &path);
+    ~IntervalRecorder();
+
+    IntervalRecorder(const IntervalRecorder &) = delete;
+    IntervalRecorder &operator=(const IntervalRecorder &) = delete;
+
+    void start();
+    void on_timer(); // Called when timer_fd is readable
+    void finish();   // Last, partial interval
+
+    // Per-interval deltas of the last interval, for triggers
+    const std::vector<uint64_t> &last_deltas() const { return deltas; }
+    int event_index(const std::string &name) const;
+    // Last interval delta of an event, or the derived ipc or cache_miss_rate
+    bool value(const std::string &name, double &value) const;
+    // Sum of the scaled deltas of an event since start()
+    bool total(const std::string &name, uint64_t &total) const;
+
+private:
+    CounterGroup &group;
+    uint64_t interval_ms;
+    bool binary;
+    std::ofstream file;
+    std::ostream *out;
+    uint64_t start_ns = 0;
+    std::vector<uint64_t> previous; // Raw counts of the last read
+    uint64_t previous_enabled = 0, previous_running = 0;
+    std::vector<uint64_t> deltas;   // Scaled
+    std::vector<uint64_t> totals;
+    std::vector<std::string> derived_names;
+    int cycles = -1, instructions = -1, cache_references = -1, cache_misses = -1;
+
+    std::vector<double> derived() const;
+    void emit(uint64_t now_ns);
+};
+
+#endif // INTERVAL_H
@@ -0,0 +1,307 @@
+#include "JitSymbols.h"
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+// New perf map lines and jitdump records are looked for at most this often
+#define JIT_REFRESH_NS 1000000ULL
+// A missing perf map or jitdump is looked for again after this long
+#define JIT_OPEN_RETRY_NS 100000000ULL
+// Replaced code kept for samples taken before the replacement
+#define JIT_MAX_RETIRED 65536
+
+#define JITDUMP_FLAGS_ARCH_TIMESTAMP 1
+
+struct JitdumpHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+struct JitdumpRecord {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+};
+
+struct JitdumpCodeLoad {
+    uint32_t pid, tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+    // Followed by the NUL terminated name and the code
+};
+
+struct JitdumpCodeMove {
+    uint32_t pid, tid;
+    uint64_t vma;
+    uint64_t old_code_addr;
+    uint64_t new_code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+};
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+JitSymbols::~JitSymbols() {
+    for (auto &[pid, jit] : processes) {
+        if (jit.perf_map.fd != -1) {
+            close(jit.perf_map.fd);
+        }
+        for (const auto &file : jit.jitdumps) {
+            if (file.fd != -1) {
+                close(file.fd);
+            }
+        }
+    }
+}
+
+JitSymbols::Process &JitSymbols::process(uint32_t pid) {
+    auto [it, inserted] = processes.try_emplace(pid);
+    if (inserted) {
+        it->second.perf_map.path = "/tmp/perf-" + std::to_string(pid) + ".map";
+    }
+    return it->second;
+}
+
+// jit-<pid>.dump, mapped executable by the runtime so that it shows up in MMAP records
+void JitSymbols::on_mmap(uint32_t pid, const std::string &filename) {
+    size_t slash = filename.rfind('/');
+    std::string base = slash == std::string::npos ? filename : filename.substr(slash + 1);
+    if (base.rfind("jit-", 0) != 0 || base.size() < 9 || base.compare(base.size() - 5, 5, ".dump") != 0) {
+        return;
+    }
+
+    Process &jit = process(pid);
+    for (const auto &file : jit.jitdumps) {
+        if (file.path == filename) {
+            return;
+        }
+    }
+    JitFile file;
+    file.path = filename;
+    jit.jitdumps.push_back(file);
+    jit.last_refresh_ns = 0; // Read it with the next sample
+}
+
+bool JitSymbols::read_new(JitFile &file, uint64_t now) {
+    if (file.fd == -1) {
+        if (file.last_open_ns && now - file.last_open_ns < JIT_OPEN_RETRY_NS) {
+            return false;
+        }
+        file.last_open_ns = now;
+        file.fd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file.fd == -1) {
+            return false;
+        }
+    }
+
+    bool read_any = false;
+    char buffer[65536];
+    ssize_t size;
+    while ((size = pread(file.fd, buffer, sizeof(buffer), file.offset)) > 0) {
+        file.pending.append(buffer, size);
+        file.offset += size;
+        read_any = true;
+    }
+    return read_any;
+}
+
+void JitSymbols::refresh(Process &jit, uint64_t now) {
+    jit.last_refresh_ns = now;
+    if (read_new(jit.perf_map, now)) {
+        parse_perf_map(jit);
+    }
+    for (auto &file : jit.jitdumps) {
+        if (read_new(file, now)) {
+            parse_jitdump(jit, file);
+        }
+    }
+}
+
+// "START SIZE symbol" per line, hex numbers, later lines replace the code they overlap
+void JitSymbols::parse_perf_map(Process &jit) {
+    std::string &pending = jit.perf_map.pending;
+    size_t line_start = 0;
+    for (size_t newline; (newline = pending.find('\n', line_start)) != std::string::npos; line_start = newline + 1) {
+        std::string line = pending.substr(line_start, newline - line_start);
+        char *end;
+        uint64_t start = strtoull(line.c_str(), &end, 16);
+        char *size_end;
+        uint64_t size = strtoull(end, &size_end, 16);
+        if (size_end == end || size == 0) {
+            continue;
+        }
+        while (*size_end == ' ' || *size_end == '\t') {
+            ++size_end;
+        }
+        load(jit, start, size, size_end, 0);
+    }
+    pending.erase(0, line_start);
+}
+
+void JitSymbols::parse_jitdump(Process &jit, JitFile &file) {
+    std::string &pending = file.pending;
+    size_t offset = 0;
+
+    if (!file.header_read) {
+        JitdumpHeader header;
+        if (pending.size() < sizeof(header)) {
+            return;
+        }
+        memcpy(&header, pending.data(), sizeof(header));
+        if (header.magic != JITDUMP_MAGIC || header.total_size < sizeof(header)) {
+            // Not a jitdump (or the other byte order), stop reading it
+            close(file.fd);
+            file.fd = -1;
+            file.last_open_ns = UINT64_MAX;
+            pending.clear();
+            return;
+        }
+        if (pending.size() < header.total_size) {
+            return;
+        }
+        file.header_read = true;
+        file.monotonic_time = !(header.flags & JITDUMP_FLAGS_ARCH_TIMESTAMP);
+        offset = header.total_size;
+    }
+
+    JitdumpRecord record;
+    while (pending.size() - offset >= sizeof(record)) {
+        memcpy(&record, pending.data() + offset, sizeof(record));
+        if (record.total_size < sizeof(record)) {
+            break; // Malformed, nothing after it can be trusted
+        }
+        if (pending.size() - offset < record.total_size) {
+            break; // Still being written
+        }
+
+        const char *body = pending.data() + offset + sizeof(record);
+        size_t body_size = record.total_size - sizeof(record);
+        uint64_t time = file.monotonic_time ? record.timestamp : 0;
+
+        if (record.id == JIT_CODE_LOAD && body_size > sizeof(JitdumpCodeLoad)) {
+            JitdumpCodeLoad code;
+            memcpy(&code, body, sizeof(code));
+            const char *name = body + sizeof(code);
+            size_t name_length = strnlen(name, body_size - sizeof(code));
+            load(jit, code.code_addr, code.code_size, std::string(name, name_length), time);
+        } else if (record.id == JIT_CODE_MOVE && body_size >= sizeof(JitdumpCodeMove)) {
+            JitdumpCodeMove move;
+            memcpy(&move, body, sizeof(move));
+            auto it = jit.code.find(move.old_code_addr);
+            if (it != jit.code.end()) {
+                std::string name = it->second.name;
+                unload(jit, it, time);
+                load(jit, move.new_code_addr, move.code_size, name, time);
+            }
+        }
+        offset += record.total_size;
+    }
+    pending.erase(0, offset);
+}
+
+void JitSymbols::load(Process &jit, uint64_t start, uint64_t size, const std::string &name, uint64_t load_time) {
+    uint64_t end = start + size;
+
+    // Code the new one overlaps is gone from now on
+    auto it = jit.code.lower_bound(start);
+    if (it != jit.code.begin() && std::prev(it)->second.end > start) {
+        --it;
+    }
+    while (it != jit.code.end() && it->first < end) {
+        it = unload(jit, it, load_time);
+    }
+    jit.code[start] = {end, load_time, name};
+}
+
+// Without a time the code cannot be told apart from its replacement and is just dropped
+std::map<uint64_t, JitSymbols::JitCode>::iterator JitSymbols::unload(Process &jit, std::map<uint64_t, JitCode>::iterator code,
+                                                                     uint64_t unload_time) {
+    if (unload_time) {
+        auto retired = jit.retired.insert({code->first, {code->second.end, code->second.load_time, unload_time, code->second.name}});
+        jit.retired_order.push_back(retired);
+        jit.max_retired_size = std::max(jit.max_retired_size, code->second.end - code->first);
+        if (jit.retired_order.size() > JIT_MAX_RETIRED) {
+            jit.retired.erase(jit.retired_order.front());
+            jit.retired_order.pop_front();
+        }
+    }
+    return jit.code.erase(code);
+}
+
+const std::string *JitSymbols::find(Process &jit, uint64_t ip, uint64_t time) {
+    const JitCode *current = nullptr;
+    auto it = jit.code.upper_bound(ip);
+    if (it != jit.code.begin() && ip < std::prev(it)->second.end) {
+        current = &std::prev(it)->second;
+    }
+    if (current && (time == 0 || current->load_time <= time)) {
+        return &current->name;
+    }
+
+    // Taken before the current code was loaded, or in code replaced since
+    if (time) {
+        auto retired = jit.retired.upper_bound(ip);
+        while (retired != jit.retired.begin()) {
+            --retired;
+            if (ip - retired->first >= jit.max_retired_size) {
+                break; // Starts too far below to contain ip
+            }
+            const RetiredCode &code = retired->second;
+            if (ip < code.end && code.load_time <= time && time < code.unload_time) {
+                return &code.name;
+            }
+        }
+    }
+    return current ? &current->name : nullptr;
+}
+
+const std::string *JitSymbols::attribute_sample(uint32_t pid, uint64_t ip, uint64_t time) {
+    Process &jit = process(pid);
+    uint64_t now = monotonic_ns();
+    if (now - jit.last_refresh_ns >= JIT_REFRESH_NS) {
+        refresh(jit, now);
+    }
+
+    const std::string *symbol = find(jit, ip, time);
+    if (symbol && !symbol->empty()) {
+        symbol_samples[*symbol]++;
+        return symbol;
+    }
+    return nullptr;
+}
+
+void JitSymbols::print(uint64_t total_samples, size_t max_symbols) {
+    std::vector<std::pair<std::string, uint64_t>> sorted(symbol_samples.begin(), symbol_samples.end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+
+    uint64_t jit_samples = 0;
+    for (const auto &entry : sorted) {
+        jit_samples += entry.second;
+    }
+
+    std::streamsize precision = std::cout.precision();
+    std::cout << "\nJIT symbols (" << jit_samples << " of " << total_samples << " samples in JIT code):\n";
+    std::cout << std::fixed << std::setprecision(1);
+    for (size_t i = 0; i < sorted.size() && i < max_symbols; ++i) {
+        std::cout << std::setw(10) << sorted[i].second << std::setw(8) << 100.0 * sorted[i].second / total_samples << "%  "
+                  << sorted[i].first << "\n";
+    }
+    std::cout.unsetf(std::ios::fixed);
+    std::cout.precision(precision);
+}
@@ -0,0 +1,87 @@
+#ifndef JIT_SYMBOLS_H
+#define JIT_SYMBOLS_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <cstdint>
+
+#define JITDUMP_MAGIC 0x4A695444 // "JiTD"
+
+// jitdump record ids
+#define JIT_CODE_LOAD 0
+#define JIT_CODE_MOVE 1
+
+// Symbols of JIT-compiled code in anonymous mappings, from the
+// /tmp/perf-<pid>.map file and the jit-<pid>.dump files that runtimes write
+// (a jitdump is found through the MMAP record of its PROT_EXEC mapping).
+// Both are read incrementally as they grow. Code a newer load overlaps is
+// retired with its lifetime, so with sample times a sample resolves to the
+// symbol that was live when it was taken, not to whatever was compiled there
+// since. Perf map entries carry no time and are valid from the start.
+class JitSymbols {
+public:
+    std::unordered_map<std::string, uint64_t> symbol_samples;
+
+    JitSymbols() = default;
+    ~JitSymbols();
+
+    JitSymbols(const JitSymbols &) = delete;
+    JitSymbols &operator=(const JitSymbols &) = delete;
+
+    void on_mmap(uint32_t pid, const std::string &filename);
+    // Symbol at ip for a sample taken at time (CLOCK_MONOTONIC, 0 if unknown), nullptr outside JIT code
+    const std::string *attribute_sample(uint32_t pid, uint64_t ip, uint64_t time);
+
+    void print(uint64_t total_samples, size_t max_symbols = 30);
+
+private:
+    struct JitCode {
+        uint64_t end;
+        uint64_t load_time; // 0: valid from the start
+        std::string name;
+    };
+
+    struct RetiredCode {
+        uint64_t end;
+        uint64_t load_time, unload_time;
+        std::string name;
+    };
+    using RetiredMap = std::multimap<uint64_t, RetiredCode>; // By start, generations of the same range overlap
+
+    // A file read from where the previous read stopped
+    struct JitFile {
+        std::string path;
+        int fd = -1;
+        uint64_t offset = 0;
+        std::string pending;         // A record or line not complete yet
+        bool header_read = false;    // jitdump only
+        bool monotonic_time = false; // jitdump timestamps on the sample clock
+        uint64_t last_open_ns = 0;
+    };
+
+    struct Process {
+        std::map<uint64_t, JitCode> code; // By start, not overlapping
+        RetiredMap retired;
+        std::deque<RetiredMap::iterator> retired_order; // Oldest first
+        uint64_t max_retired_size = 0;                  // Candidates for an ip start at most this far below it
+        JitFile perf_map;
+        std::vector<JitFile> jitdumps;
+        uint64_t last_refresh_ns = 0;
+    };
+
+    std::unordered_map<uint32_t, Process> processes;
+
+    Process &process(uint32_t pid);
+    void refresh(Process &process, uint64_t now);
+    bool read_new(JitFile &file, uint64_t now);
+    void parse_perf_map(Process &process);
+    void parse_jitdump(Process &process, JitFile &file);
+    void load(Process &process, uint64_t start, uint64_t size, const std::string &name, uint64_t load_time);
+    std::map<uint64_t, JitCode>::iterator unload(Process &process, std::map<uint64_t, JitCode>::iterator code, uint64_t unload_time);
+    const std::string *find(Process &process, uint64_t ip, uint64_t time);
+};
+
+#endif // JIT_SYMBOLS_H
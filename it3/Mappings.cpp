@@ -0,0 +1,23 @@
+#include "Mappings.h"
+
+void add_mmap_record(MmapRecords &records, uint64_t start, const MmapRecord &record) {
+    auto it = records.lower_bound(start);
+    if (it != records.begin() && std::prev(it)->second.end > start) {
+        --it;
+    }
+    while (it != records.end() && it->first < record.end) {
+        it = records.erase(it);
+    }
+    records[start] = record;
+}
+
+const MmapRecord *find_mmap_record(const MmapRecords &records, uint64_t address) {
+    auto it = records.upper_bound(address);
+    if (it != records.begin()) {
+        --it;
+        if (address < it->second.end) {
+            return &it->second;
+        }
+    }
+    return nullptr;
+}
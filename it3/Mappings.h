@@ -0,0 +1,26 @@
+#ifndef MAPPINGS_H
+#define MAPPINGS_H
+
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <cstdint>
+
+// A code mapping from a PERF_RECORD_MMAP, by start address
+struct MmapRecord {
+    uint64_t end;
+    uint64_t pgoff; // File offset of the start
+    std::string filename;
+};
+using MmapRecords = std::map<uint64_t, MmapRecord>;
+
+// Mappings of every monitored process by pid, an address only means something within its process
+using ProcessMmaps = std::unordered_map<uint32_t, MmapRecords>;
+
+// A new mapping replaces whatever it overlaps, like mmap does
+void add_mmap_record(MmapRecords &records, uint64_t start, const MmapRecord &record);
+
+// Mapping containing the address, nullptr when there is none
+const MmapRecord *find_mmap_record(const MmapRecords &records, uint64_t address);
+
+#endif // MAPPINGS_H
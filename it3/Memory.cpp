@@ -0,0 +1,161 @@
+#include "Memory.h"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+// A miss re-reads /proc/<pid>/maps at most this often
+#define PROC_MAPS_INTERVAL_NS 100000000ULL
+
+static std::string category_of(const std::string &name) {
+    if (name == "[heap]") {
+        return "heap";
+    }
+    if (name.rfind("[stack", 0) == 0) {
+        return "stack";
+    }
+    if (name.empty() || name == "//anon" || name.rfind("/dev/zero", 0) == 0 || name.rfind("/memfd:", 0) == 0) {
+        return "anon";
+    }
+    if (name[0] == '/') {
+        return "file";
+    }
+    return "other"; // [vdso], [vvar] and friends
+}
+
+void MemTracker::on_mmap(uint32_t pid, uint64_t addr, uint64_t len, const std::string &filename) {
+    ProcessMaps &maps = processes[pid];
+
+    // A new mapping replaces whatever it overlaps
+    auto it = maps.mappings.lower_bound(addr);
+    if (it != maps.mappings.begin() && std::prev(it)->second.end > addr) {
+        --it;
+    }
+    while (it != maps.mappings.end() && it->first < addr + len) {
+        it = maps.mappings.erase(it);
+    }
+    maps.mappings[addr] = {addr + len, filename};
+}
+
+void MemTracker::read_proc_maps(uint32_t pid, ProcessMaps &maps) {
+    uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    if (now - maps.last_proc_read_ns < PROC_MAPS_INTERVAL_NS) {
+        return;
+    }
+    maps.last_proc_read_ns = now;
+
+    std::ifstream file("/proc/" + std::to_string(pid) + "/maps");
+    std::string line;
+    while (std::getline(file, line)) {
+        // start-end perms offset dev inode path
+        std::istringstream fields(line);
+        std::string range, perms, offset, dev, inode, path;
+        fields >> range >> perms >> offset >> dev >> inode;
+        std::getline(fields >> std::ws, path);
+
+        size_t dash = range.find('-');
+        if (dash == std::string::npos) {
+            continue;
+        }
+        uint64_t start = std::stoull(range.substr(0, dash), nullptr, 16);
+        uint64_t end = std::stoull(range.substr(dash + 1), nullptr, 16);
+        if (maps.mappings.find(start) == maps.mappings.end()) {
+            maps.mappings[start] = {end, path.empty() ? "//anon" : path};
+        }
+    }
+}
+
+const MemTracker::Mapping *MemTracker::find_mapping(uint32_t pid, uint64_t addr, uint64_t &start) {
+    ProcessMaps &maps = processes[pid];
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        auto it = maps.mappings.upper_bound(addr);
+        if (it != maps.mappings.begin()) {
+            --it;
+            if (addr < it->second.end) {
+                start = it->first;
+                return &it->second;
+            }
+        }
+        if (attempt == 0) {
+            read_proc_maps(pid, maps);
+        }
+    }
+    return nullptr;
+}
+
+void MemTracker::on_sample(uint32_t pid, uint64_t addr) {
+    samples++;
+
+    uint64_t start = 0;
+    const Mapping *mapping = find_mapping(pid, addr, start);
+    std::string category = mapping ? category_of(mapping->name) : "unmapped";
+    category_samples[category]++;
+
+    if (mapping) {
+        RegionStats &region = region_samples[{pid, start}];
+        region.name = mapping->name;
+        region.category = category;
+        region.end = mapping->end;
+        region.samples++;
+    }
+
+    page_samples[{pid, addr >> SMALL_PAGE_SHIFT}]++;
+
+    HugeArea &area = huge_areas[{pid, addr >> HUGE_PAGE_SHIFT}];
+    area.category = category;
+    area.samples++;
+    area.pages.set((addr >> SMALL_PAGE_SHIFT) & ((1 << (HUGE_PAGE_SHIFT - SMALL_PAGE_SHIFT)) - 1));
+}
+
+template <typename Entry, typename Compare>
+static std::vector<Entry> top_entries(std::vector<Entry> entries, size_t count, Compare compare) {
+    std::sort(entries.begin(), entries.end(), compare);
+    if (entries.size() > count) {
+        entries.resize(count);
+    }
+    return entries;
+}
+
+void MemTracker::print(size_t max_entries) {
+    std::cout << "\nData address samples per mapping type (total " << samples << "):\n";
+    for (const auto &entry : category_samples) {
+        std::cout << "Type: " << entry.first << ", Samples: " << entry.second << "\n";
+    }
+
+    std::vector<std::pair<Key, RegionStats>> regions(region_samples.begin(), region_samples.end());
+    regions = top_entries(regions, max_entries, [](const auto &a, const auto &b) { return a.second.samples > b.second.samples; });
+    std::cout << "\nHot mappings:\n";
+    for (const auto &[key, region] : regions) {
+        std::cout << "PID " << key.first << " 0x" << std::hex << key.second << "-0x" << region.end << std::dec
+                  << " " << region.name << " (" << region.category << "), Samples: " << region.samples << "\n";
+    }
+
+    std::vector<std::pair<Key, uint64_t>> pages(page_samples.begin(), page_samples.end());
+    pages = top_entries(pages, max_entries, [](const auto &a, const auto &b) { return a.second > b.second; });
+    std::cout << "\nHot pages (4K):\n";
+    for (const auto &[key, count] : pages) {
+        std::cout << "PID " << key.first << " Page: 0x" << std::hex << (key.second << SMALL_PAGE_SHIFT) << std::dec
+                  << ", Samples: " << count << "\n";
+    }
+
+    // Anonymous memory touched on many of its 4K pages gains the most from a 2M page
+    std::vector<std::pair<Key, const HugeArea *>> candidates;
+    for (const auto &[key, area] : huge_areas) {
+        if ((area.category == "heap" || area.category == "anon") && area.pages.count() > 1) {
+            candidates.push_back({key, &area});
+        }
+    }
+    candidates = top_entries(candidates, max_entries, [](const auto &a, const auto &b) {
+        return a.second->pages.count() != b.second->pages.count() ? a.second->pages.count() > b.second->pages.count()
+                                                                   : a.second->samples > b.second->samples;
+    });
+    std::cout << "\nHuge page candidates (2M areas of heap/anon memory):\n";
+    for (const auto &[key, area] : candidates) {
+        std::cout << "PID " << key.first << " Area: 0x" << std::hex << (key.second << HUGE_PAGE_SHIFT) << std::dec
+                  << " (" << area->category << "), 4K pages touched: " << area->pages.count()
+                  << "/" << area->pages.size() << ", Samples: " << area->samples << "\n";
+    }
+}
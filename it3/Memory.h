@@ -0,0 +1,60 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <string>
+#include <map>
+#include <bitset>
+#include <unordered_map>
+#include <cstdint>
+
+#define SMALL_PAGE_SHIFT 12
+#define HUGE_PAGE_SHIFT 21
+
+// Data address profile for the memory mode: attributes the PERF_SAMPLE_ADDR
+// of page-fault or precise memory samples to the mappings of the process
+// (from MMAP records, /proc/<pid>/maps for mappings made before monitoring).
+class MemTracker {
+public:
+    void on_mmap(uint32_t pid, uint64_t addr, uint64_t len, const std::string &filename);
+    void on_sample(uint32_t pid, uint64_t addr);
+
+    void print(size_t max_entries = 20);
+
+private:
+    struct Mapping {
+        uint64_t end;
+        std::string name;
+    };
+
+    struct ProcessMaps {
+        std::map<uint64_t, Mapping> mappings;
+        uint64_t last_proc_read_ns = 0;
+    };
+
+    struct RegionStats {
+        std::string name;
+        std::string category;
+        uint64_t end = 0;
+        uint64_t samples = 0;
+    };
+
+    struct HugeArea {
+        std::string category;
+        uint64_t samples = 0;
+        std::bitset<1 << (HUGE_PAGE_SHIFT - SMALL_PAGE_SHIFT)> pages; // 4K pages with samples
+    };
+
+    using Key = std::pair<uint32_t, uint64_t>; // pid and address
+
+    std::unordered_map<uint32_t, ProcessMaps> processes;
+    std::map<std::string, uint64_t> category_samples;
+    std::map<Key, RegionStats> region_samples; // By mapping start
+    std::map<Key, uint64_t> page_samples;      // By 4K page
+    std::map<Key, HugeArea> huge_areas;        // By 2M area
+    uint64_t samples = 0;
+
+    const Mapping *find_mapping(uint32_t pid, uint64_t addr, uint64_t &start);
+    void read_proc_maps(uint32_t pid, ProcessMaps &maps);
+};
+
+#endif // MEMORY_H
@@ -0,0 +1,94 @@
+#include "OffCpu.h"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+
+#define MAX_PRINTED_FRAMES 16
+
+void OffCpuTracker::on_sample(uint32_t pid, uint32_t tid, const Stack &stack) {
+    oncpu_samples[{pid, stack}]++;
+    ThreadState &thread = threads[tid];
+    thread.pid = pid;
+    thread.last_sample = stack;
+}
+
+// The context-switches software event fires right before the PERF_RECORD_SWITCH of the same switch-out
+void OffCpuTracker::on_switch_sample(uint32_t pid, uint32_t tid, const Stack &stack) {
+    ThreadState &thread = threads[tid];
+    thread.pid = pid;
+    thread.switch_stack = stack;
+    thread.has_switch_stack = true;
+    switch_samples++;
+}
+
+void OffCpuTracker::on_switch(uint32_t tid, uint64_t time, bool switch_out, bool preempt) {
+    ThreadState &thread = threads[tid];
+
+    if (switch_out) {
+        // Without the switch event (no privileges for it) the last on-CPU sample stands in
+        thread.off_cpu_stack = thread.has_switch_stack ? thread.switch_stack : thread.last_sample;
+        thread.has_switch_stack = false;
+        thread.off_cpu = true;
+        thread.preempted = preempt;
+        thread.switch_out_time = time;
+        return;
+    }
+
+    if (thread.off_cpu && time >= thread.switch_out_time) {
+        uint64_t interval = time - thread.switch_out_time;
+        if (thread.preempted) {
+            preempted_ns[{thread.pid, thread.off_cpu_stack}] += interval;
+        } else {
+            blocked_ns[{thread.pid, thread.off_cpu_stack}] += interval;
+        }
+    }
+    thread.off_cpu = false;
+}
+
+static std::string format_frame(uint64_t ip, const MmapRecords *mmap_records) {
+    std::ostringstream frame;
+    frame << "0x" << std::hex << ip << std::dec;
+    const MmapRecord *record = mmap_records ? find_mmap_record(*mmap_records, ip) : nullptr;
+    if (record) {
+        frame << " (" << record->filename << ")";
+    }
+    return frame.str();
+}
+
+static void print_stacks(const std::string &title, const std::map<ProcessStack, uint64_t> &stacks, const std::string &unit,
+                         const ProcessMmaps &mmap_records, size_t max_stacks) {
+    std::vector<std::pair<const ProcessStack *, uint64_t>> sorted;
+    uint64_t total = 0;
+    for (const auto &entry : stacks) {
+        sorted.push_back({&entry.first, entry.second});
+        total += entry.second;
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+
+    std::cout << "\n" << title << " (total " << total << " " << unit << ", " << stacks.size() << " stacks):\n";
+    for (size_t i = 0; i < sorted.size() && i < max_stacks; ++i) {
+        std::cout << "Stack: " << sorted[i].second << " " << unit << "\n";
+        const auto &[pid, stack] = *sorted[i].first;
+        if (stack.empty()) {
+            std::cout << "    <no callchain>\n";
+        }
+        auto records = mmap_records.find(pid);
+        const MmapRecords *process_records = records != mmap_records.end() ? &records->second : nullptr;
+        for (size_t frame = 0; frame < stack.size() && frame < MAX_PRINTED_FRAMES; ++frame) {
+            std::cout << "    " << format_frame(stack[frame], process_records) << "\n";
+        }
+        if (stack.size() > MAX_PRINTED_FRAMES) {
+            std::cout << "    ... " << stack.size() - MAX_PRINTED_FRAMES << " more frames\n";
+        }
+    }
+}
+
+void OffCpuTracker::print(const ProcessMmaps &mmap_records, size_t max_stacks) {
+    print_stacks("On-CPU samples per stack", oncpu_samples, "samples", mmap_records, max_stacks);
+    print_stacks("Blocked time per stack", blocked_ns, "ns", mmap_records, max_stacks);
+    print_stacks("Preempted time per stack", preempted_ns, "ns", mmap_records, max_stacks);
+    if (switch_samples == 0) {
+        std::cout << "\nNo switch-out callchains, off-CPU stacks are those of the last on-CPU sample.\n";
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef OFFCPU_H
+#define OFFCPU_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <cstdint>
+#include "Mappings.h"
+
+// User space callchain, innermost frame first
+using Stack = std::vector<uint64_t>;
+// Callchain with the pid whose mappings its addresses belong to
+using ProcessStack = std::pair<uint32_t, Stack>;
+
+// Off-CPU (wall-clock) profile built from context switches. A thread is off
+// CPU from its switch-out to its next switch-in; the interval is charged to
+// the callchain it was switched out with.
+class OffCpuTracker {
+public:
+    std::map<ProcessStack, uint64_t> oncpu_samples; // Samples of the sampling event per stack
+    std::map<ProcessStack, uint64_t> blocked_ns;    // Time off CPU after blocking, per stack
+    std::map<ProcessStack, uint64_t> preempted_ns;  // Time off CPU while still runnable, per stack
+    uint64_t switch_samples = 0;             // Switch-out samples with a callchain
+
+    void on_sample(uint32_t pid, uint32_t tid, const Stack &stack);
+    void on_switch_sample(uint32_t pid, uint32_t tid, const Stack &stack);
+    void on_switch(uint32_t tid, uint64_t time, bool switch_out, bool preempt);
+
+    void print(const ProcessMmaps &mmap_records, size_t max_stacks = 20);
+
+private:
+    struct ThreadState {
+        uint32_t pid = 0;
+        Stack last_sample;     // Callchain of the latest on-CPU sample
+        Stack switch_stack;    // Callchain of the latest switch-out sample
+        bool has_switch_stack = false;
+        bool off_cpu = false;
+        bool preempted = false;
+        uint64_t switch_out_time = 0;
+        Stack off_cpu_stack;
+    };
+
+    std::unordered_map<uint32_t, ThreadState> threads;
+};
+
+#endif // OFFCPU_H
@@ -3,32 +3,139 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fstream>
+#include <sstream>
 
+// Supported event names. Software events work on machines without a PMU.
+static const std::unordered_map<std::string, std::pair<uint32_t, uint64_t>> event_types = {
+    {"instructions", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS}},
+    {"cycles", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES}},
+    {"cache-references", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES}},
+    {"cache-misses", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}},
+    {"cpu-clock", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK}},
+    {"task-clock", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK}},
+    {"page-faults", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}},
+    {"minor-faults", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN}},
+    {"major-faults", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ}},
+    {"context-switches", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES}},
+    {"dummy", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_DUMMY}}, // Never samples, for the MMAP, COMM and task records
+};
+
+#define SYSFS_CPU_PMU "/sys/bus/event_source/devices/cpu/"
+
+// Events the core PMU exports in sysfs, e.g. the precise mem-loads and mem-stores.
+// The event file holds terms like "event=0xcd,umask=0x1,ldlat=3", the format
+// files tell which config bits each term goes to, like "config:0-7" or
+// "config:0-7,32-35" where the value is spread over the ranges low bits first.
+static bool sysfs_event(const std::string &event_name, struct perf_event_attr &pe) {
+    std::ifstream type_file(SYSFS_CPU_PMU "type");
+    std::ifstream event_file(SYSFS_CPU_PMU "events/" + event_name);
+    std::string terms;
+    if (!(type_file >> pe.type) || !std::getline(event_file, terms)) {
+        return false;
+    }
+
+    std::istringstream term_stream(terms);
+    std::string term;
+    while (std::getline(term_stream, term, ',')) {
+        size_t equals = term.find('=');
+        std::string key = term.substr(0, equals);
+        uint64_t value = 1;
+        if (equals != std::string::npos) {
+            std::string text = term.substr(equals + 1);
+            char *end;
+            value = strtoull(text.c_str(), &end, 0);
+            if (text.empty() || *end != '\0') {
+                // "?" is a parameter the user has to give, like ldlat=? in perf
+                std::cerr << "Event " << event_name << ": unsupported value \"" << text << "\" for " << key << ".\n";
+                return false;
+            }
+        }
+
+        std::ifstream format_file(SYSFS_CPU_PMU "format/" + key);
+        std::string format;
+        if (!std::getline(format_file, format)) {
+            return false;
+        }
+        size_t colon = format.find(':');
+        if (colon == std::string::npos) {
+            return false;
+        }
+        std::string field = format.substr(0, colon);
+        __u64 *config = field == "config" ? &pe.config : field == "config1" ? &pe.config1 : &pe.config2;
+
+        std::istringstream range_stream(format.substr(colon + 1));
+        std::string range;
+        while (std::getline(range_stream, range, ',')) {
+            char *end;
+            unsigned long low = strtoul(range.c_str(), &end, 10);
+            unsigned long high = *end == '-' ? strtoul(end + 1, &end, 10) : low;
+            if (high < low || high > 63) {
+                return false;
+            }
+            unsigned long width = high - low + 1;
+            uint64_t mask = width == 64 ? ~0ULL : (1ULL << width) - 1;
+            *config |= (value & mask) << low;
+            value = width == 64 ? 0 : value >> width;
+        }
+    }
+    return true;
+}
+
+bool lookup_event(const std::string &event_name, struct perf_event_attr &pe) {
+    auto type = event_types.find(event_name);
+    if (type != event_types.end()) {
+        pe.type = type->second.first;
+        pe.config = type->second.second;
+        return true;
+    }
+    return sysfs_event(event_name, pe);
+}
 
 // Constructor for PerfEvent
-PerfEvent::PerfEvent(const std::string &event_name, bool is_sampling, pid_t pid, uint64_t sample_period)
-    : event_name(event_name), is_sampling(is_sampling), pid(pid), sample_period(sample_period) {
+PerfEvent::PerfEvent(const std::string &event_name, bool is_sampling, pid_t pid, uint64_t sample_period, uint64_t sample_type,
+                     bool track_switches, int cpu, unsigned long open_flags, size_t buffer_size, bool overwrite, bool inherit)
+    : event_name(event_name), is_sampling(is_sampling), mmap_buffer(nullptr), mmap_size(0), pid(pid), sample_period(sample_period), sample_type(sample_type),
+      track_switches(track_switches), switch_fd(-1), switch_id(0), cpu(cpu), open_flags(open_flags), overwrite(overwrite), inherit(inherit), precise_ip(0) {
     struct perf_event_attr pe;
     memset(&pe, 0, sizeof(struct perf_event_attr));
     pe.size = sizeof(struct perf_event_attr);
-    pe.type = PERF_TYPE_HARDWARE;
-
-    if (event_name == "instructions") {
-        pe.config = PERF_COUNT_HW_INSTRUCTIONS;
-    } else if (event_name == "cycles") {
-        pe.config = PERF_COUNT_HW_CPU_CYCLES;
-    } else if (event_name == "cache-misses") {
-        pe.config = PERF_COUNT_HW_CACHE_MISSES;
-    } else {
+
+    if (!lookup_event(event_name, pe)) {
         std::cerr << "Unsupported event type.\n";
         exit(EXIT_FAILURE);
     }
+    // PMU events only report the exact data address when sampled precisely
+    if (pe.type != PERF_TYPE_SOFTWARE && (sample_type & PERF_SAMPLE_ADDR)) {
+        pe.precise_ip = 3;
+    }
 
     if (is_sampling) {
         pe.sample_period = sample_period;
-        pe.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID;
+        pe.sample_type = sample_type;
         pe.wakeup_events = 1;
     }
+    // Without samples to wake on, the records of the dummy event wake the reader when the buffer is half full
+    if (is_sampling && pe.type == PERF_TYPE_SOFTWARE && pe.config == PERF_COUNT_SW_DUMMY) {
+        pe.watermark = 1;
+        pe.wakeup_watermark = (buffer_size - sysconf(_SC_PAGESIZE)) / 2;
+    }
+
+    // Nobody polls an overwrite buffer: newest records at data_head
+    if (overwrite) {
+        pe.wakeup_events = 0;
+        pe.write_backward = 1;
+    }
+    // Children in the same buffer, per-CPU events only
+    if (inherit) {
+        pe.inherit = 1;
+    }
+
+    // Sample times on the clock used by prof_region.h
+    if (sample_type & PERF_SAMPLE_TIME) {
+        pe.use_clockid = 1;
+        pe.clockid = CLOCK_MONOTONIC;
+    }
 
     pe.disabled = 1;
     pe.exclude_kernel = 1;
@@ -36,11 +143,34 @@ PerfEvent::PerfEvent(const std::string &event_name, bool is_sampling, pid_t pid,
     pe.task = 1; // To track FORK and EXIT events
     pe.mmap = 1; // To tracl MMAP events
     pe.comm = 1;
+    pe.comm_exec = 1; // Marks the COMM records of an exec
+    pe.mmap_data = (sample_type & PERF_SAMPLE_ADDR) != 0; // Data mappings to attribute sample addresses to
+
+    // Samples of the switch event share the buffer, the identifier tells them apart
+    if (track_switches) {
+        this->sample_type |= PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_TID | PERF_SAMPLE_TIME;
+        pe.sample_type = this->sample_type;
+        pe.use_clockid = 1;
+        pe.clockid = CLOCK_MONOTONIC;
+        pe.context_switch = 1;
+        pe.sample_id_all = 1;
+    }
+
+    fd = perf_event_open(&pe, pid, cpu, -1, open_flags);
+
+    // Fall back to the best precision the PMU supports for this event, x86 fails with EOPNOTSUPP
+    while (fd == -1 && (errno == EINVAL || errno == EOPNOTSUPP) && pe.precise_ip > 0) {
+        pe.precise_ip--;
+        fd = perf_event_open(&pe, pid, cpu, -1, open_flags);
+    }
+    precise_ip = pe.precise_ip;
 
-    fd = perf_event_open(&pe, pid, -1, -1, 0);
     if (fd == -1) {
     	if (errno == ESRCH) {
 		std::cerr << "Process is too fast. Unable to attach to PID " << pid << ".\n";
+    	} else if (pid == 0 && open_flags == 0) {
+            // Self-profiling must not take the application down, fd == -1 tells the caller
+            perror(("perf_event_open " + event_name).c_str());
     	} else {
 		error_and_exit("perf_event_open");
         }
@@ -49,130 +179,188 @@ PerfEvent::PerfEvent(const std::string &event_name, bool is_sampling, pid_t pid,
     }
 
     if (is_sampling) {
-        mmap_buffer = mmap(NULL, BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        // Without PROT_WRITE there is no data_tail and the kernel overwrites the oldest records
+        mmap_size = buffer_size;
+        mmap_buffer = mmap(NULL, mmap_size, overwrite ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
         if (mmap_buffer == MAP_FAILED) {
             error_and_exit("mmap");
         }
+        if (track_switches) {
+            open_switch_event();
+        }
+    } else {
+        // The user page of a counting event carries what rdpmc needs, without it read() is used
+        mmap_size = sysconf(_SC_PAGESIZE);
+        mmap_buffer = mmap(NULL, mmap_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mmap_buffer == MAP_FAILED) {
+            mmap_buffer = nullptr;
+        }
     }
 
-    if (fd != -1) {
-	ioctl(fd, PERF_EVENT_IOC_RESET, 0);
-	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
-    }
+    reset();
+    enable();
 }
 
 // Destructor for PerfEvent
 PerfEvent::~PerfEvent() {
-    if (is_sampling && mmap_buffer) {
-        munmap(mmap_buffer, BUFFER_SIZE);
+    if (mmap_buffer) {
+        munmap(mmap_buffer, mmap_size);
+    }
+    if (switch_fd != -1) {
+        close(switch_fd);
     }
     if (fd != -1) {
 	close(fd);
     }
 }
 
-// Read event count
-void PerfEvent::read_count() {
-    if (fd == -1) {
-	return;
+// A context-switches sample with period 1 is taken at every switch-out and carries the callchain
+// of the blocking call. It fires in the kernel, so it needs exclude_kernel = 0 and may not be allowed.
+void PerfEvent::open_switch_event() {
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(struct perf_event_attr));
+    pe.size = sizeof(struct perf_event_attr);
+    pe.type = PERF_TYPE_SOFTWARE;
+    pe.config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+    pe.sample_period = 1;
+    pe.sample_type = sample_type | PERF_SAMPLE_CALLCHAIN;
+    pe.use_clockid = 1;
+    pe.clockid = CLOCK_MONOTONIC;
+    pe.sample_id_all = 1;
+    pe.exclude_callchain_kernel = 1;
+    pe.exclude_hv = 1;
+    pe.disabled = 1;
+    pe.inherit = inherit;
+
+    // The output buffer has to be on the same CPU
+    switch_fd = perf_event_open(&pe, pid, cpu, -1, 0);
+    if (switch_fd == -1) {
+        return;
+    }
+    if (ioctl(switch_fd, PERF_EVENT_IOC_SET_OUTPUT, fd) == -1 || ioctl(switch_fd, PERF_EVENT_IOC_ID, &switch_id) == -1) {
+        close(switch_fd);
+        switch_fd = -1;
+        return;
     }
+    ioctl(switch_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
 
-    long long count;
-    if (read(fd, &count, sizeof(long long)) == -1) {
-        error_and_exit("read");
+std::unique_ptr<PerfEvent> PerfEvent::self(const std::string &event_name) {
+    struct perf_event_attr pe = {};
+    if (!lookup_event(event_name, pe)) {
+        return nullptr;
     }
-    std::cout << "Event count (" << event_name << ") for PID " << pid << ": " << count << "\n\n";
+    return std::make_unique<PerfEvent>(event_name, false, 0);
 }
 
-// Read and process samples
-void PerfEvent::read_samples(std::unordered_map<int, PerfEvent*> &events_map, std::unordered_map<std::string, int> &global_histogram, std::map<uint64_t, std::pair<uint64_t, std::string>> &global_mmap_records, std::unordered_map<uint64_t, int> &global_ip_histogram) {
-    if (mmap_buffer == nullptr || fd == -1) {
-	return;
+std::unique_ptr<PerfEvent> PerfEvent::cgroup(const std::string &event_name, bool is_sampling, int cgroup_fd, int cpu,
+                                             uint64_t sample_period, uint64_t sample_type) {
+    return std::make_unique<PerfEvent>(event_name, is_sampling, cgroup_fd, sample_period, sample_type, false, cpu, PERF_FLAG_PID_CGROUP);
+}
+
+std::unique_ptr<PerfEvent> PerfEvent::task(const std::string &event_name, pid_t pid, int cpu, uint64_t sample_period,
+                                           uint64_t sample_type, bool track_switches) {
+    return std::make_unique<PerfEvent>(event_name, true, pid, sample_period, sample_type, track_switches, cpu, 0, TASK_BUFFER_SIZE, false, true);
+}
+
+std::unique_ptr<PerfEvent> PerfEvent::flight_recorder(const std::string &event_name, pid_t pid, int cpu, uint64_t sample_period,
+                                                      uint64_t sample_type, size_t buffer_size) {
+    return std::make_unique<PerfEvent>(event_name, true, pid, sample_period, sample_type, false, cpu, 0, buffer_size, true, true);
+}
+
+std::unique_ptr<PerfEvent> PerfEvent::sideband(pid_t pid, int cpu, size_t buffer_size) {
+    return std::make_unique<PerfEvent>("dummy", true, pid, 1, DEFAULT_SAMPLE_TYPE, false, cpu, 0, buffer_size, false, true);
+}
+
+void PerfEvent::enable() {
+    if (fd != -1) {
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
     }
+}
 
-    struct perf_event_mmap_page *header = (struct perf_event_mmap_page *)mmap_buffer;
-    char *data = (char *)mmap_buffer + header->data_offset;
-    uint64_t data_head = header->data_head;
-    asm volatile("" ::: "memory");
-    uint64_t data_tail = header->data_tail;
-
-
-    while (data_tail < data_head) {
-        struct perf_event_header *event = (struct perf_event_header *)(data + (data_tail & (BUFFER_SIZE - 1)));
-	if (event == nullptr) return;
-        if (event->type == PERF_RECORD_SAMPLE) {
-            // The sample contains the IP and TID (pid/tid) data
-            uint64_t ip;
-            memcpy(&ip, (char *)event + sizeof(struct perf_event_header), sizeof(uint64_t));
-            uint32_t pid, tid;
-            memcpy(&pid, (char *)event + sizeof(struct perf_event_header) + sizeof(uint64_t), sizeof(uint32_t));
-            memcpy(&tid, (char *)event + sizeof(struct perf_event_header) + sizeof(uint64_t) + sizeof(uint32_t), sizeof(uint32_t));
-            // std::cout << "IP: " << std::hex << ip << std::dec << " PID: " << pid << "\n";
-
-            uint64_t *sample = (uint64_t *)((uint8_t *)event + sizeof(struct perf_event_header));
-            ip = *sample;
-
-	    // Updating global ip hist
-            global_ip_histogram[ip]++;
-
-            // Updating global lib hist
-            for (const auto& [start_addr, info] : global_mmap_records) {
-                const auto& [end_addr, filename] = info;
-                if (ip >= start_addr && ip < end_addr) {
-                    global_histogram[filename]++;
-                    break;
-                }
-            }
+void PerfEvent::disable() {
+    if (fd != -1) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+}
 
-        } else if (event->type == PERF_RECORD_FORK) {
-            struct { uint32_t pid, ppid, tid, ptid; } fork;
-            memcpy(&fork, (char *)event + sizeof(struct perf_event_header), sizeof(fork));
-            std::cout << "FORK event: PID " << fork.pid << " PPID " << fork.ppid << "\n";
-
-            // Create a new PerfEvent for the forked process
-            PerfEvent* new_event = new PerfEvent(event_name, is_sampling, fork.pid, sample_period);
-            if (new_event->fd != -1) {
-		events_map[new_event->fd] = new_event;
-            } else {
-		delete new_event;
+void PerfEvent::reset() {
+    if (fd != -1) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    }
+}
+
+// rdpmc reads the counter of the current CPU, so it only works for events on the calling thread
+bool PerfEvent::rdpmc_available() const {
+#if defined(__x86_64__) || defined(__i386__)
+    if (is_sampling || pid != 0 || open_flags != 0 || mmap_buffer == nullptr) {
+        return false;
+    }
+    const struct perf_event_mmap_page *page = (const struct perf_event_mmap_page *)mmap_buffer;
+    return page->cap_user_rdpmc && page->index != 0;
+#else
+    return false;
+#endif
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t rdpmc(uint32_t counter) {
+    uint32_t low, high;
+    asm volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+    return (uint64_t)high << 32 | low;
+}
+#endif
+
+// Current count, from userspace when possible and from read() otherwise
+uint64_t PerfEvent::read_value() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (!is_sampling && pid == 0 && open_flags == 0 && mmap_buffer != nullptr) {
+        volatile struct perf_event_mmap_page *page = (volatile struct perf_event_mmap_page *)mmap_buffer;
+        uint32_t seq, index;
+        uint64_t count;
+
+        // The kernel updates the page under a sequence lock
+        do {
+            seq = page->lock;
+            asm volatile("" ::: "memory");
+            index = page->index;
+            count = page->offset;
+            if (page->cap_user_rdpmc && index != 0) {
+                uint16_t width = page->pmc_width;
+                // Sign extend the width bits, the left shift on unsigned to stay defined
+                int64_t pmc = (int64_t)(rdpmc(index - 1) << (64 - width));
+                pmc >>= 64 - width;
+                count += pmc;
             }
-        } else if (event->type == PERF_RECORD_MMAP) {
-            struct {
-                struct perf_event_header header;
-                uint32_t pid, tid;
-                uint64_t addr, len, pgoff;
-                char filename[256];
-            } *mmap_event = (decltype(mmap_event)) event;
-
-            uint64_t start_addr = mmap_event->addr;
-            uint64_t end_addr = start_addr + mmap_event->len;
-
-            // Updating mmap records
-            global_mmap_records[start_addr] = {end_addr, mmap_event->filename};
-
-
-            // Mmap info
-            std::cout << "mmap event: pid=" << mmap_event->pid << ", tid=" << mmap_event->tid
-                      << ", addr=" << mmap_event->addr << ", len=" << mmap_event->len
-                      << ", pgoff=" << mmap_event->pgoff << ", filename=" << mmap_event->filename << std::endl; 
-        } else if (event->type == PERF_RECORD_COMM) {
-            struct {
-                struct perf_event_header header;
-                uint32_t pid, tid;
-                char comm[16];
-            } *comm_event = (decltype(comm_event)) event;
-
-            // Print COMM event info
-            std::cout << "COMM event: Process " << comm_event->pid 
-                      << " changed name to " << comm_event->comm << "\n";
-        } else {
-            // std::cout << "Other event type: " << event->type << "\n";
-            data_tail += event->size;
-            break;
+            asm volatile("" ::: "memory");
+        } while (page->lock != seq);
+
+        if (page->cap_user_rdpmc && index != 0) {
+            return count;
         }
-	    data_tail += event->size;
+    }
+#endif
+    return read_value_syscall();
+}
+
+uint64_t PerfEvent::read_value_syscall() {
+    if (fd == -1) {
+        return 0;
     }
 
-    header->data_tail = data_tail;
-    asm volatile("" ::: "memory");
+    uint64_t count;
+    if (read(fd, &count, sizeof(uint64_t)) == -1) {
+        error_and_exit("read");
+    }
+    return count;
+}
+
+// Read event count
+void PerfEvent::read_count() {
+    if (fd == -1) {
+	return;
+    }
+
+    uint64_t count = read_value();
+    std::cout << "Event count (" << event_name << ") for PID " << pid << ": " << count << "\n\n";
 }
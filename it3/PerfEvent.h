@@ -5,22 +5,82 @@
 #include <cstring>
 #include <unordered_map>
 #include <map>
+#include <memory>
+#include <vector>
 #include "utils.h"
 
+#define DEFAULT_SAMPLE_TYPE (PERF_SAMPLE_IP | PERF_SAMPLE_TID)
+
+// Sets type and config of the attr for a supported event name
+bool lookup_event(const std::string &event_name, struct perf_event_attr &pe);
+
+class PerfEvent;
+struct ProfileData;  // Profile.h, the monitor side
+struct StreamSample; // SampleStream.h
+
+// Monitored events by fd, events for forked tasks are added while draining
+using EventMap = std::unordered_map<int, std::unique_ptr<PerfEvent>>;
+
+// A single perf event. Counting events can also be opened on the calling
+// thread (pid 0) and read with read_value(), which uses rdpmc from userspace
+// when the kernel allows it.
 class PerfEvent {
 public:
     int fd;
     std::string event_name;
     bool is_sampling;
-    void *mmap_buffer;
+    void *mmap_buffer; // Ring buffer for sampling events, the user page only for counting events
+    size_t mmap_size;
     pid_t pid;
     uint64_t sample_period;
+    uint64_t sample_type;
+    bool track_switches; // PERF_RECORD_SWITCH records and switch-out callchains for off-CPU profiling
+    int switch_fd;       // context-switches event writing into this buffer, -1 if not available
+    uint64_t switch_id;
+    int cpu;             // -1 to follow the task to any CPU
+    unsigned long open_flags; // PERF_FLAG_PID_CGROUP when pid is a cgroup directory fd
+    bool overwrite;      // Read-only write_backward buffer the kernel keeps overwriting, read by read_snapshot()
+    bool inherit;        // Covers the children of the task, no events are opened for them on FORK
+    int precise_ip;      // Skid level the PMU accepted, for data address samples of PMU events
 
-    PerfEvent(const std::string &event_name, bool is_sampling, pid_t pid, uint64_t sample_period = 0);
+    PerfEvent(const std::string &event_name, bool is_sampling, pid_t pid, uint64_t sample_period = 0, uint64_t sample_type = DEFAULT_SAMPLE_TYPE,
+              bool track_switches = false, int cpu = -1, unsigned long open_flags = 0, size_t buffer_size = BUFFER_SIZE, bool overwrite = false,
+              bool inherit = false);
     ~PerfEvent();
 
+    PerfEvent(const PerfEvent &) = delete;
+    PerfEvent &operator=(const PerfEvent &) = delete;
+
+    // Counting event on the calling thread, nullptr for an unknown event name
+    static std::unique_ptr<PerfEvent> self(const std::string &event_name);
+    // Event for every task of a cgroup (v2 directory fd) while it runs on the CPU
+    static std::unique_ptr<PerfEvent> cgroup(const std::string &event_name, bool is_sampling, int cgroup_fd, int cpu,
+                                             uint64_t sample_period = 0, uint64_t sample_type = DEFAULT_SAMPLE_TYPE);
+    // Sampling event on one CPU for the task and the threads and children it creates, which
+    // are sampled from their first instruction on instead of after their FORK record is read
+    static std::unique_ptr<PerfEvent> task(const std::string &event_name, pid_t pid, int cpu, uint64_t sample_period,
+                                           uint64_t sample_type, bool track_switches);
+    // Overwrite buffer on one CPU for the task and the children it creates, buffer_size is a page plus 2^n pages
+    static std::unique_ptr<PerfEvent> flight_recorder(const std::string &event_name, pid_t pid, int cpu, uint64_t sample_period,
+                                                      uint64_t sample_type, size_t buffer_size);
+    // MMAP, COMM and task records of the task and its children on one CPU, without samples
+    static std::unique_ptr<PerfEvent> sideband(pid_t pid, int cpu, size_t buffer_size);
+
+    void enable();
+    void disable();
+    void reset();
+
+    bool rdpmc_available() const;
+    uint64_t read_value();
+    uint64_t read_value_syscall();
     void read_count();
-    void read_samples(std::unordered_map<int, PerfEvent*> &events_map, std::unordered_map<std::string, int> &global_histogram, std::map<uint64_t, std::pair<uint64_t, std::string>> &global_mmap_records, std::unordered_map<uint64_t, int> &global_ip_histogram);
+    // Draining the sampling buffers is part of the monitor, in Profile.cpp
+    void read_samples(EventMap &events_map, ProfileData &profile);
+    // Samples in an overwrite buffer, newest first, with output paused while reading
+    void read_snapshot(std::vector<StreamSample> &samples);
+
+private:
+    void open_switch_event();
 };
 
 #endif // PERFEVENT_H
@@ -0,0 +1,388 @@
+#include "Profile.h"
+#include "Regions.h"
+#include "OffCpu.h"
+#include "Memory.h"
+#include "SourceLines.h"
+#include "SampleStream.h"
+#include "JitSymbols.h"
+#include "Export.h"
+#include "FlightRecorder.h"
+#include <sys/ioctl.h>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+// Fields of a PERF_RECORD_SAMPLE, present according to sample_type
+struct SampleFields {
+    uint64_t id = 0;
+    uint64_t ip = 0;
+    uint32_t pid = 0, tid = 0;
+    uint64_t time = 0;
+    uint64_t addr = 0;
+    Stack callchain; // User frames only
+};
+
+// The sample fields follow in sample_type bit order
+static void parse_sample(const struct perf_event_header *event, uint64_t sample_type, SampleFields &sample) {
+    const char *field = (const char *)event + sizeof(struct perf_event_header);
+    const char *end = (const char *)event + event->size;
+    auto next_u64 = [&field]() {
+        uint64_t value;
+        memcpy(&value, field, sizeof(uint64_t));
+        field += sizeof(uint64_t);
+        return value;
+    };
+
+    if (sample_type & PERF_SAMPLE_IDENTIFIER) {
+        sample.id = next_u64();
+    }
+    if (sample_type & PERF_SAMPLE_IP) {
+        sample.ip = next_u64();
+    }
+    if (sample_type & PERF_SAMPLE_TID) {
+        memcpy(&sample.pid, field, sizeof(uint32_t));
+        memcpy(&sample.tid, field + sizeof(uint32_t), sizeof(uint32_t));
+        field += 2 * sizeof(uint32_t);
+    }
+    if (sample_type & PERF_SAMPLE_TIME) {
+        sample.time = next_u64();
+    }
+    if (sample_type & PERF_SAMPLE_ADDR) {
+        sample.addr = next_u64();
+    }
+    if (sample_type & PERF_SAMPLE_ID) {
+        sample.id = next_u64();
+    }
+    if (sample_type & PERF_SAMPLE_STREAM_ID) {
+        next_u64();
+    }
+    if (sample_type & PERF_SAMPLE_CPU) {
+        next_u64();
+    }
+    if (sample_type & PERF_SAMPLE_PERIOD) {
+        next_u64();
+    }
+    if (sample_type & PERF_SAMPLE_CALLCHAIN) {
+        uint64_t nr = next_u64();
+        sample.callchain.clear();
+        for (uint64_t i = 0; i < nr && field + sizeof(uint64_t) <= end; ++i) {
+            uint64_t ip = next_u64();
+            if (ip < PERF_CONTEXT_MAX) { // Skip the PERF_CONTEXT_* markers
+                sample.callchain.push_back(ip);
+            }
+        }
+    }
+}
+
+// The sample_id_all trailer of non-sample records, it is the last part of the record
+static void parse_sample_id(const struct perf_event_header *event, uint64_t sample_type, SampleFields &sample) {
+    size_t size = 0;
+    size += (sample_type & PERF_SAMPLE_TID) ? 8 : 0;
+    size += (sample_type & PERF_SAMPLE_TIME) ? 8 : 0;
+    size += (sample_type & PERF_SAMPLE_ID) ? 8 : 0;
+    size += (sample_type & PERF_SAMPLE_STREAM_ID) ? 8 : 0;
+    size += (sample_type & PERF_SAMPLE_CPU) ? 8 : 0;
+    size += (sample_type & PERF_SAMPLE_IDENTIFIER) ? 8 : 0;
+    if (size > event->size - sizeof(struct perf_event_header)) {
+        return;
+    }
+
+    const char *field = (const char *)event + event->size - size;
+    if (sample_type & PERF_SAMPLE_TID) {
+        memcpy(&sample.pid, field, sizeof(uint32_t));
+        memcpy(&sample.tid, field + sizeof(uint32_t), sizeof(uint32_t));
+        field += 8;
+    }
+    if (sample_type & PERF_SAMPLE_TIME) {
+        memcpy(&sample.time, field, sizeof(uint64_t));
+    }
+}
+
+void read_proc_maps(uint32_t pid, ProfileData &profile) {
+    if (!profile.proc_maps_read.insert(pid).second) {
+        return;
+    }
+
+    MmapRecords &records = profile.mmap_records[pid];
+    std::ifstream file("/proc/" + std::to_string(pid) + "/maps");
+    std::string line;
+    while (std::getline(file, line)) {
+        // start-end perms offset dev inode path
+        std::istringstream fields(line);
+        std::string range, perms, offset, dev, inode, path;
+        fields >> range >> perms >> offset >> dev >> inode;
+        std::getline(fields >> std::ws, path);
+
+        size_t dash = range.find('-');
+        if (dash == std::string::npos || perms.find('x') == std::string::npos) {
+            continue; // Only code, like the MMAP records without mmap_data
+        }
+        uint64_t start = std::stoull(range.substr(0, dash), nullptr, 16);
+        uint64_t end = std::stoull(range.substr(dash + 1), nullptr, 16);
+        if (path.empty()) {
+            path = "//anon";
+        }
+
+        // An MMAP record seen already is newer
+        records.emplace(start, MmapRecord{end, std::stoull(offset, nullptr, 16), path});
+        if (profile.jit) {
+            profile.jit->on_mmap(pid, path);
+        }
+    }
+}
+
+static const std::string *find_module(const ProfileData &profile, uint32_t pid, uint64_t ip) {
+    auto records = profile.mmap_records.find(pid);
+    if (records == profile.mmap_records.end()) {
+        return nullptr;
+    }
+    const MmapRecord *record = find_mmap_record(records->second, ip);
+    return record ? &record->filename : nullptr;
+}
+
+// //anon, /memfd: and [anon:...] mappings, where JIT compilers put their code
+static bool is_anonymous(const std::string &filename) {
+    return filename.empty() || filename[0] != '/' || filename.rfind("//anon", 0) == 0 || filename.rfind("/memfd:", 0) == 0;
+}
+
+// Read and process samples
+void PerfEvent::read_samples(EventMap &events_map, ProfileData &profile) {
+    if (!is_sampling || overwrite || mmap_buffer == nullptr || fd == -1) {
+	return;
+    }
+
+    struct perf_event_mmap_page *header = (struct perf_event_mmap_page *)mmap_buffer;
+    char *data = (char *)mmap_buffer + header->data_offset;
+    uint64_t data_size = header->data_size;
+    uint64_t data_head = header->data_head;
+    asm volatile("" ::: "memory");
+    uint64_t data_tail = header->data_tail;
+
+    // Records may wrap around the end of the data area, those are copied here
+    alignas(8) char record[UINT16_MAX + 1];
+    SampleFields sample;
+
+    while (data_tail < data_head) {
+        uint64_t offset = data_tail & (data_size - 1);
+        struct perf_event_header *event = (struct perf_event_header *)(data + offset);
+        if (event->size == 0) break;
+        if (offset + event->size > data_size) {
+            uint64_t first = data_size - offset;
+            memcpy(record, data + offset, first);
+            memcpy(record + first, data, event->size - first);
+            event = (struct perf_event_header *)record;
+        }
+
+        if (event->type == PERF_RECORD_SAMPLE) {
+            parse_sample(event, sample_type, sample);
+
+            // Switch-out samples only carry the blocking callchain
+            if (switch_fd != -1 && sample.id == switch_id) {
+                if (profile.offcpu) {
+                    profile.offcpu->on_switch_sample(sample.pid, sample.tid, sample.callchain);
+                }
+                data_tail += event->size;
+                continue;
+            }
+
+            uint64_t ip = sample.ip;
+            profile.samples++;
+
+            if (profile.regions) {
+                profile.regions->attribute_sample(sample.tid, sample.time);
+            }
+            if (profile.offcpu) {
+                profile.offcpu->on_sample(sample.pid, sample.tid, sample.callchain);
+            }
+            if (profile.memory && (sample_type & PERF_SAMPLE_ADDR)) {
+                profile.memory->on_sample(sample.pid, sample.addr);
+            }
+            if (profile.stream) {
+                profile.stream->add(sample.pid, sample.tid, sample.time, ip, sample.callchain, event->size);
+            }
+
+	    // Updating global ip hist
+            profile.ip_histogram[ip]++;
+
+            // Updating global lib hist
+            const std::string *module = find_module(profile, sample.pid, ip);
+            if (module == nullptr && profile.proc_maps && !profile.proc_maps_read.count(sample.pid)) {
+                read_proc_maps(sample.pid, profile);
+                module = find_module(profile, sample.pid, ip);
+            }
+
+            // JIT code runs from anonymous memory, the runtime names it
+            const std::string *jit_symbol = nullptr;
+            if (profile.jit && (module == nullptr || is_anonymous(*module))) {
+                jit_symbol = profile.jit->attribute_sample(sample.pid, ip, sample.time);
+            }
+            if (jit_symbol) {
+                profile.histogram["[jit]"]++;
+                module = jit_symbol;
+            } else if (module) {
+                profile.histogram[*module]++;
+            }
+
+            if (profile.trace) {
+                profile.trace->sample(sample.pid, sample.tid, sample.time, module ? *module : "[unknown]", ip);
+            }
+
+        } else if (event->type == PERF_RECORD_FORK) {
+            struct { uint32_t pid, ppid, tid, ptid; } fork;
+            memcpy(&fork, (char *)event + sizeof(struct perf_event_header), sizeof(fork));
+            std::cout << "FORK event: PID " << fork.pid << " PPID " << fork.ppid << " TID " << fork.tid << "\n";
+            if (fork.pid != fork.ppid) {
+                // A new process starts with the mappings of its parent, replacing those of an earlier process with its pid
+                auto parent = profile.mmap_records.find(fork.ppid);
+                if (parent != profile.mmap_records.end()) {
+                    profile.mmap_records[fork.pid] = parent->second;
+                } else {
+                    profile.mmap_records.erase(fork.pid);
+                }
+                profile.proc_maps_read.erase(fork.pid);
+                if (profile.stream) {
+                    profile.stream->add_fork(fork.pid, fork.ppid);
+                }
+            }
+
+            // A cgroup or inherited event already covers the new task
+            if (inherit || (open_flags & PERF_FLAG_PID_CGROUP)) {
+                data_tail += event->size;
+                continue;
+            }
+
+            // Create a new PerfEvent for the new task, a thread has its own tid
+            auto new_event = std::make_unique<PerfEvent>(event_name, is_sampling, fork.tid, sample_period, sample_type, track_switches);
+            if (new_event->fd != -1) {
+                int new_fd = new_event->fd;
+		events_map[new_fd] = std::move(new_event);
+            }
+        } else if (event->type == PERF_RECORD_MMAP) {
+            struct {
+                struct perf_event_header header;
+                uint32_t pid, tid;
+                uint64_t addr, len, pgoff;
+                char filename[256];
+            } *mmap_event = (decltype(mmap_event)) event;
+
+            uint64_t start_addr = mmap_event->addr;
+            uint64_t end_addr = start_addr + mmap_event->len;
+
+            // Updating mmap records
+            add_mmap_record(profile.mmap_records[mmap_event->pid], start_addr, {end_addr, mmap_event->pgoff, mmap_event->filename});
+            if (profile.memory) {
+                profile.memory->on_mmap(mmap_event->pid, start_addr, mmap_event->len, mmap_event->filename);
+            }
+            if (profile.jit) {
+                profile.jit->on_mmap(mmap_event->pid, mmap_event->filename);
+            }
+            if (profile.lines) {
+                profile.lines->on_mmap(start_addr, mmap_event->len, mmap_event->pgoff, mmap_event->filename);
+            }
+            if (profile.stream) {
+                profile.stream->add_mmap({mmap_event->pid, start_addr, mmap_event->len, mmap_event->pgoff, "", mmap_event->filename});
+            }
+
+
+            // Mmap info
+            std::cout << "mmap event: pid=" << mmap_event->pid << ", tid=" << mmap_event->tid
+                      << ", addr=" << mmap_event->addr << ", len=" << mmap_event->len
+                      << ", pgoff=" << mmap_event->pgoff << ", filename=" << mmap_event->filename << std::endl;
+        } else if (event->type == PERF_RECORD_COMM) {
+            struct {
+                struct perf_event_header header;
+                uint32_t pid, tid;
+                char comm[16];
+            } *comm_event = (decltype(comm_event)) event;
+
+            // Print COMM event info
+            std::cout << "COMM event: Process " << comm_event->pid
+                      << " changed name to " << comm_event->comm << "\n";
+            // An exec replaces every mapping, the MMAP records of the new image follow
+            if (event->misc & PERF_RECORD_MISC_COMM_EXEC) {
+                profile.mmap_records.erase(comm_event->pid);
+            }
+            StreamComm comm = {comm_event->pid, comm_event->tid, std::string(comm_event->comm, strnlen(comm_event->comm, sizeof(comm_event->comm)))};
+            if (profile.stream) {
+                profile.stream->add_comm(comm);
+            }
+            if (profile.flight) {
+                profile.flight->on_comm(comm);
+            }
+        } else if (event->type == PERF_RECORD_EXIT) {
+            struct { uint32_t pid, ppid, tid, ptid; } exit;
+            memcpy(&exit, (char *)event + sizeof(struct perf_event_header), sizeof(exit));
+            if (profile.regions) {
+                profile.regions->on_exit(exit.tid);
+            }
+            if (profile.flight) {
+                profile.flight->on_exit(exit.pid, exit.tid);
+            }
+        } else if (event->type == PERF_RECORD_SWITCH) {
+            parse_sample_id(event, sample_type, sample);
+            if (profile.offcpu) {
+                bool switch_out = event->misc & PERF_RECORD_MISC_SWITCH_OUT;
+                bool preempt = event->misc & PERF_RECORD_MISC_SWITCH_OUT_PREEMPT;
+                profile.offcpu->on_switch(sample.tid, sample.time, switch_out, preempt);
+            }
+        } else if (event->type == PERF_RECORD_LOST) {
+            struct { uint64_t id, lost; } lost;
+            memcpy(&lost, (char *)event + sizeof(struct perf_event_header), sizeof(lost));
+            profile.lost += lost.lost;
+            if (profile.stream) {
+                profile.stream->add_lost(lost.lost);
+            }
+        }
+	    data_tail += event->size;
+    }
+
+    asm volatile("" ::: "memory");
+    header->data_tail = data_tail;
+}
+
+void PerfEvent::read_snapshot(std::vector<StreamSample> &samples) {
+    if (!overwrite || mmap_buffer == nullptr || fd == -1) {
+        return;
+    }
+
+    struct perf_event_mmap_page *header = (struct perf_event_mmap_page *)mmap_buffer;
+    char *data = (char *)mmap_buffer + header->data_offset;
+    uint64_t data_size = header->data_size;
+
+    // Paused, the kernel drops new samples instead of overwriting the ones being read
+    ioctl(fd, PERF_EVENT_IOC_PAUSE_OUTPUT, 1);
+    uint64_t data_head = __atomic_load_n(&header->data_head, __ATOMIC_ACQUIRE);
+
+    alignas(8) char record[UINT16_MAX + 1];
+    SampleFields sample;
+
+    // A backward buffer holds whole records from data_head up to at most data_size bytes later,
+    // the rest is zeroed (not yet written) or the remains of an overwritten record
+    for (uint64_t read = 0; read < data_size; ) {
+        uint64_t offset = (data_head + read) & (data_size - 1);
+        struct perf_event_header *event = (struct perf_event_header *)(data + offset);
+        if (event->size == 0 || read + event->size > data_size) {
+            break;
+        }
+        if (offset + event->size > data_size) {
+            uint64_t first = data_size - offset;
+            memcpy(record, data + offset, first);
+            memcpy(record + first, data, event->size - first);
+            event = (struct perf_event_header *)record;
+        }
+
+        if (event->type == PERF_RECORD_SAMPLE) {
+            parse_sample(event, sample_type, sample);
+            StreamSample snapshot_sample;
+            snapshot_sample.pid = sample.pid;
+            snapshot_sample.tid = sample.tid;
+            snapshot_sample.time = sample.time;
+            snapshot_sample.ip = sample.ip;
+            snapshot_sample.callchain = sample.callchain;
+            samples.push_back(std::move(snapshot_sample));
+        }
+        read += event->size;
+    }
+
+    ioctl(fd, PERF_EVENT_IOC_PAUSE_OUTPUT, 0);
+}
@@ -0,0 +1,43 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+#include "PerfEvent.h"
+#include "Mappings.h"
+
+class RegionTracker;
+class OffCpuTracker;
+class MemTracker;
+class SourceLineTracker;
+class SampleEncoder;
+class JitSymbols;
+class ChromeTraceWriter;
+class FlightRecorder;
+
+// Everything collected from the sampling buffers of all monitored tasks
+struct ProfileData {
+    std::unordered_map<std::string, int> histogram;
+    ProcessMmaps mmap_records; // Code mappings by pid
+    std::unordered_map<uint64_t, int> ip_histogram;
+    uint64_t samples = 0; // PERF_RECORD_SAMPLE records drained
+    uint64_t lost = 0;    // Samples reported lost by PERF_RECORD_LOST
+    RegionTracker *regions = nullptr; // Set when samples are joined against prof_region.h markers
+    OffCpuTracker *offcpu = nullptr;  // Set when context switches are tracked
+    MemTracker *memory = nullptr;     // Set when sample data addresses are profiled
+    SourceLineTracker *lines = nullptr; // Set when samples are attributed to source lines
+    SampleEncoder *stream = nullptr;    // Set when samples are written as a compact stream
+    JitSymbols *jit = nullptr;          // Set when JIT code is symbolized from perf maps and jitdumps
+    ChromeTraceWriter *trace = nullptr; // Set when timestamped samples are exported
+    FlightRecorder *flight = nullptr;   // Set for the sideband of the flight recorder, which tracks names and exits
+    bool proc_maps = false;             // Set when tasks are sampled that were not followed from their start
+    std::unordered_set<uint32_t> proc_maps_read; // Pids whose /proc/<pid>/maps was read
+};
+
+// Adds the executable mappings of a task from /proc/<pid>/maps, once per pid. They
+// were made before monitoring started and have no MMAP records.
+void read_proc_maps(uint32_t pid, ProfileData &profile);
+
+#endif // PROFILE_H
@@ -0,0 +1,153 @@
+#include "Regions.h"
+#include "utils.h"
+#include <iomanip>
+#include <algorithm>
+
+RegionTracker::RegionTracker() : tail(0) {
+    name = "/perf_monitor_regions." + std::to_string(getpid());
+
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        error_and_exit("shm_open");
+    }
+    if (ftruncate(fd, sizeof(prof::RegionShm)) == -1) {
+        error_and_exit("ftruncate");
+    }
+    void *addr = mmap(NULL, sizeof(prof::RegionShm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        error_and_exit("mmap");
+    }
+
+    // The file is zero filled, which is a valid empty ring
+    shm = (prof::RegionShm *)addr;
+    shm->magic = PROF_REGIONS_MAGIC;
+}
+
+RegionTracker::~RegionTracker() {
+    munmap(shm, sizeof(prof::RegionShm));
+    shm_unlink(name.c_str());
+}
+
+// Move the completed ring entries to the queues of their threads
+void RegionTracker::drain() {
+    uint64_t head = shm->head.load(std::memory_order_acquire);
+    if (head - tail > PROF_REGIONS_CAPACITY) {
+        overruns += head - tail - PROF_REGIONS_CAPACITY;
+        tail = head - PROF_REGIONS_CAPACITY;
+    }
+
+    while (tail < head) {
+        prof::RegionEntry &entry = shm->entries[tail & (PROF_REGIONS_CAPACITY - 1)];
+        uint64_t seq = entry.seq.load(std::memory_order_acquire);
+        if (seq < tail + 1) {
+            break; // Writer has not finished this entry yet
+        }
+        if (seq > tail + 1) {
+            overruns++; // Already reused by a later entry
+            tail++;
+            continue;
+        }
+
+        // Copy, then make sure a writer that wrapped around did not change it meanwhile
+        uint64_t time = entry.time;
+        uint32_t pid = entry.pid;
+        uint32_t tid = entry.tid;
+        uint16_t region = entry.region;
+        uint16_t kind = entry.kind;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (entry.seq.load(std::memory_order_relaxed) != seq) {
+            overruns++;
+            tail++;
+            continue;
+        }
+
+        threads[tid].pending.push_back({time, region, kind});
+        if (trace) {
+            trace->region(pid, tid, time, region_name(region), kind == prof::REGION_ENTER);
+        }
+        tail++;
+    }
+
+    if (latest_sample_time >= pruned_time + 2 * REGIONS_REPLAY_LAG_NS) {
+        prune();
+    }
+}
+
+void RegionTracker::replay(ThreadState &thread, uint64_t time) {
+    while (!thread.pending.empty() && thread.pending.front().time <= time) {
+        const RegionEvent &event = thread.pending.front();
+        if (event.kind == prof::REGION_ENTER) {
+            thread.stack.push_back(event.region);
+        } else if (!thread.stack.empty()) {
+            thread.stack.pop_back();
+        }
+        thread.pending.pop_front();
+    }
+}
+
+// Threads that are rarely sampled would keep every event they record: replay those that no sample
+// can come before any more, and forget threads with nothing left to replay that exited or are in no region
+void RegionTracker::prune() {
+    pruned_time = latest_sample_time - REGIONS_REPLAY_LAG_NS;
+    for (auto it = threads.begin(); it != threads.end();) {
+        ThreadState &thread = it->second;
+        replay(thread, pruned_time);
+        if (thread.pending.empty() && (thread.exited || thread.stack.empty())) {
+            it = threads.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void RegionTracker::on_exit(uint32_t tid) {
+    auto it = threads.find(tid);
+    if (it != threads.end()) {
+        it->second.exited = true;
+    }
+}
+
+// Replay the thread's region events up to the sample time, the innermost open region gets the sample
+void RegionTracker::attribute_sample(uint32_t tid, uint64_t time) {
+    latest_sample_time = std::max(latest_sample_time, time);
+    ThreadState &thread = threads[tid];
+    replay(thread, time);
+
+    if (thread.stack.empty()) {
+        outside_samples++;
+        return;
+    }
+
+    region_samples[region_name(thread.stack.back())]++;
+}
+
+std::string RegionTracker::region_name(uint16_t region) {
+    if (region < PROF_REGIONS_MAX_NAMES && shm->name_ready[region].load(std::memory_order_acquire)) {
+        return std::string(shm->names[region], strnlen(shm->names[region], PROF_REGIONS_NAME_LEN));
+    }
+    return "<unknown>";
+}
+
+void RegionTracker::print(const std::string &event_name, uint64_t sample_period) {
+    std::vector<std::pair<std::string, uint64_t>> sorted(region_samples.begin(), region_samples.end());
+    sorted.push_back({"<no region>", outside_samples});
+    std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+
+    uint64_t total = 0;
+    for (const auto &entry : sorted) {
+        total += entry.second;
+    }
+
+    std::streamsize precision = std::cout.precision();
+    std::cout << "\nSamples per region (" << event_name << ", period " << sample_period << "):\n";
+    for (const auto &entry : sorted) {
+        double share = total ? 100.0 * entry.second / total : 0;
+        std::cout << "Region: " << entry.first << ", Samples: " << entry.second
+                  << ", Share: " << std::fixed << std::setprecision(1) << share << "%" << std::defaultfloat << std::setprecision(precision)
+                  << ", Estimated " << event_name << ": " << entry.second * sample_period << "\n";
+    }
+    if (overruns) {
+        std::cout << "Region events lost to ring overruns: " << overruns << "\n";
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef REGIONS_H
+#define REGIONS_H
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include "prof_region.h"
+#include "Export.h"
+
+// Samples are drained from per-CPU buffers, one thread's can come in this much later than another's
+#define REGIONS_REPLAY_LAG_NS 1000000000ULL
+
+// Monitor side of prof_region.h: owns the shared memory ring and joins
+// timestamped samples against the region enter/exit events of their thread.
+class RegionTracker {
+public:
+    std::unordered_map<std::string, uint64_t> region_samples; // Samples per innermost region
+    uint64_t outside_samples = 0; // Samples outside of any region
+    uint64_t overruns = 0;        // Ring entries overwritten before they were drained
+    ChromeTraceWriter *trace = nullptr; // Gets every region enter/exit when set
+
+    RegionTracker();
+    ~RegionTracker();
+
+    const std::string &shm_name() const { return name; }
+
+    void drain();
+    void attribute_sample(uint32_t tid, uint64_t time);
+    void on_exit(uint32_t tid); // From the PERF_RECORD_EXIT of the thread
+    void print(const std::string &event_name, uint64_t sample_period);
+
+private:
+    struct RegionEvent {
+        uint64_t time;
+        uint16_t region;
+        uint16_t kind;
+    };
+
+    struct ThreadState {
+        std::deque<RegionEvent> pending; // Drained, later than the last sample
+        std::vector<uint16_t> stack;     // Regions entered and not exited
+        bool exited = false;
+    };
+
+    std::string name;
+    prof::RegionShm *shm;
+    uint64_t tail;
+    std::unordered_map<uint32_t, ThreadState> threads;
+    uint64_t latest_sample_time = 0; // Of any thread
+    uint64_t pruned_time = 0;        // Events up to here are replayed on every thread
+
+    void replay(ThreadState &thread, uint64_t time);
+    void prune();
+    std::string region_name(uint16_t region);
+};
+
+#endif // REGIONS_H
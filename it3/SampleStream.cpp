@@ -0,0 +1,357 @@
+#include "SampleStream.h"
+#include "SourceLines.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The buffer goes to the file once it is this large
+#define STREAM_FLUSH_SIZE (1 << 20)
+
+#define MAX_VARINT_SIZE 10
+
+static inline uint8_t *put_varint(uint8_t *out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+// Small negative deltas stay small
+static inline uint64_t zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+SampleEncoder::SampleEncoder(const std::string &path) {
+    if (!path.empty()) {
+        file.open(path, std::ios::binary);
+        if (!file) {
+            error_and_exit("open " + path);
+        }
+    }
+    buffer.reserve(path.empty() ? 4096 : STREAM_FLUSH_SIZE + 4096);
+    uint64_t magic = SAMPLE_STREAM_MAGIC;
+    buffer.append((const char *)&magic, sizeof(magic));
+}
+
+SampleEncoder::~SampleEncoder() {
+    flush();
+}
+
+void SampleEncoder::flush() {
+    if (!file.is_open()) {
+        return;
+    }
+    file.write(buffer.data(), buffer.size());
+    file.flush();
+    written += buffer.size();
+    buffer.clear();
+}
+
+void SampleEncoder::add(uint32_t pid, uint32_t tid, uint64_t time, uint64_t ip, const Stack &callchain, uint32_t raw_size) {
+    uint8_t record[7 * MAX_VARINT_SIZE]; // A thread definition and the sample
+    uint8_t *out = record;
+
+    // Thread dictionary
+    auto [thread, inserted] = thread_index.try_emplace((uint64_t)pid << 32 | tid, threads.size());
+    if (inserted) {
+        threads.emplace_back();
+        out = put_varint(out, STREAM_THREAD);
+        out = put_varint(out, pid);
+        out = put_varint(out, tid);
+    }
+    ThreadState &state = threads[thread->second];
+
+    // Stack dictionary, the frames of a new stack are written once
+    uint64_t stack = 0;
+    if (!callchain.empty()) {
+        auto [it, new_stack] = stack_ids.try_emplace(callchain, stack_ids.size());
+        if (new_stack) {
+            buffer.append((const char *)record, out - record);
+            out = record;
+
+            size_t start = buffer.size();
+            buffer.resize(start + (callchain.size() + 1) * MAX_VARINT_SIZE);
+            uint8_t *frames = (uint8_t *)&buffer[start];
+            uint8_t *frame_out = put_varint(frames, (uint64_t)callchain.size() << 2 | STREAM_STACK);
+            uint64_t previous = 0;
+            for (uint64_t frame : callchain) {
+                frame_out = put_varint(frame_out, zigzag(frame - previous));
+                previous = frame;
+            }
+            buffer.resize(start + (frame_out - frames));
+        }
+        stack = it->second + 1;
+    }
+
+    out = put_varint(out, (uint64_t)thread->second << 2 | STREAM_SAMPLE);
+    out = put_varint(out, zigzag(ip - state.ip));
+    out = put_varint(out, zigzag(time - state.time));
+    out = put_varint(out, stack);
+    buffer.append((const char *)record, out - record);
+
+    state.ip = ip;
+    state.time = time;
+    samples++;
+    raw_bytes += raw_size;
+
+    if (buffer.size() >= STREAM_FLUSH_SIZE) {
+        flush();
+    }
+}
+
+void SampleEncoder::add_lost(uint64_t lost) {
+    uint8_t record[MAX_VARINT_SIZE];
+    uint8_t *out = put_varint(record, lost << 4 | STREAM_LOST << 2 | STREAM_EXTENDED);
+    buffer.append((const char *)record, out - record);
+}
+
+void SampleEncoder::put_string(const std::string &value) {
+    uint8_t length[MAX_VARINT_SIZE];
+    uint8_t *out = put_varint(length, value.size());
+    buffer.append((const char *)length, out - length);
+    buffer.append(value);
+}
+
+static std::string hex_to_bytes(const std::string &hex) {
+    std::string bytes;
+    for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+        bytes += (char)std::stoi(hex.substr(i, 2), nullptr, 16);
+    }
+    return bytes;
+}
+
+static std::string bytes_to_hex(const std::string &bytes) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (unsigned char byte : bytes) {
+        hex += digits[byte >> 4];
+        hex += digits[byte & 15];
+    }
+    return hex;
+}
+
+void SampleEncoder::add_mmap(const StreamMapping &mapping) {
+    auto [build_id, inserted] = build_ids.try_emplace(mapping.filename);
+    if (!mapping.build_id.empty()) {
+        build_id->second = hex_to_bytes(mapping.build_id);
+    } else if (inserted && !mapping.filename.empty() && mapping.filename[0] == '/' && mapping.filename.rfind("//anon", 0) != 0) {
+        build_id->second = hex_to_bytes(elf_build_id(mapping.filename));
+    }
+
+    uint8_t record[5 * MAX_VARINT_SIZE];
+    uint8_t *out = put_varint(record, STREAM_MMAP << 2 | STREAM_EXTENDED);
+    out = put_varint(out, mapping.pid);
+    out = put_varint(out, mapping.start);
+    out = put_varint(out, mapping.length);
+    out = put_varint(out, mapping.pgoff);
+    buffer.append((const char *)record, out - record);
+    put_string(build_id->second);
+    put_string(mapping.filename);
+}
+
+void SampleEncoder::add_comm(const StreamComm &comm) {
+    uint8_t record[3 * MAX_VARINT_SIZE];
+    uint8_t *out = put_varint(record, STREAM_COMM << 2 | STREAM_EXTENDED);
+    out = put_varint(out, comm.pid);
+    out = put_varint(out, comm.tid);
+    buffer.append((const char *)record, out - record);
+    put_string(comm.name);
+}
+
+void SampleEncoder::add_fork(uint32_t pid, uint32_t parent_pid) {
+    uint8_t record[3 * MAX_VARINT_SIZE];
+    uint8_t *out = put_varint(record, STREAM_FORK << 2 | STREAM_EXTENDED);
+    out = put_varint(out, pid);
+    out = put_varint(out, parent_pid);
+    buffer.append((const char *)record, out - record);
+}
+
+SampleDecoder::SampleDecoder(const char *data, size_t size) {
+    open(data, size);
+}
+
+SampleDecoder::SampleDecoder(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            madvise(addr, st.st_size, MADV_SEQUENTIAL);
+            mapped = addr;
+            mapped_size = st.st_size;
+            open((const char *)mapped, mapped_size);
+        }
+    }
+    close(fd);
+}
+
+SampleDecoder::~SampleDecoder() {
+    if (mapped) {
+        munmap(mapped, mapped_size);
+    }
+}
+
+void SampleDecoder::open(const char *data, size_t size) {
+    uint64_t magic = 0;
+    if (size < sizeof(magic)) {
+        return;
+    }
+    memcpy(&magic, data, sizeof(magic));
+    ok = magic == SAMPLE_STREAM_MAGIC;
+    p = (const uint8_t *)data + sizeof(magic);
+    end = (const uint8_t *)data + size;
+}
+
+uint64_t SampleDecoder::varint() {
+    uint64_t value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    ok = false;
+    return value;
+}
+
+std::string SampleDecoder::string() {
+    uint64_t length = varint();
+    if (!ok || length > (uint64_t)(end - p)) {
+        ok = false;
+        return "";
+    }
+    std::string value((const char *)p, length);
+    p += length;
+    return value;
+}
+
+// False on a malformed or unknown record
+bool SampleDecoder::extended(uint64_t kind, uint64_t argument) {
+    switch (kind) {
+    case STREAM_LOST:
+        lost += argument;
+        return true;
+    case STREAM_MMAP: {
+        StreamMapping mapping;
+        mapping.pid = varint();
+        mapping.start = varint();
+        mapping.length = varint();
+        mapping.pgoff = varint();
+        mapping.build_id = bytes_to_hex(string());
+        mapping.filename = string();
+        if (!ok) {
+            return false;
+        }
+        process_mappings[mapping.pid][mapping.start] = mappings.size();
+        mappings.push_back(std::move(mapping));
+        return true;
+    }
+    case STREAM_COMM: {
+        StreamComm comm;
+        comm.pid = varint();
+        comm.tid = varint();
+        comm.name = string();
+        if (!ok) {
+            return false;
+        }
+        comms.push_back(std::move(comm));
+        return true;
+    }
+    case STREAM_FORK: {
+        uint32_t pid = varint();
+        uint32_t parent_pid = varint();
+        auto parent = process_mappings.find(parent_pid);
+        if (parent != process_mappings.end()) {
+            process_mappings[pid] = parent->second;
+        } else {
+            process_mappings.erase(pid);
+        }
+        return ok;
+    }
+    }
+    return false;
+}
+
+const StreamMapping *SampleDecoder::find_mapping(uint32_t pid, uint64_t ip) const {
+    auto process = process_mappings.find(pid);
+    if (process == process_mappings.end()) {
+        return nullptr;
+    }
+    auto it = process->second.upper_bound(ip);
+    if (it == process->second.begin()) {
+        return nullptr;
+    }
+    const StreamMapping &mapping = mappings[std::prev(it)->second];
+    return ip < mapping.start + mapping.length ? &mapping : nullptr;
+}
+
+bool SampleDecoder::next(StreamSample &sample) {
+    while (ok && p < end) {
+        uint64_t first = varint();
+        uint64_t argument = first >> 2;
+
+        switch (first & 3) {
+        case STREAM_THREAD: {
+            uint32_t pid = varint();
+            uint32_t tid = varint();
+            threads.push_back({pid, tid});
+            break;
+        }
+        case STREAM_STACK: {
+            if (argument > (uint64_t)(end - p)) {
+                ok = false; // Every frame takes at least a byte
+                return false;
+            }
+            Stack stack(argument);
+            uint64_t previous = 0;
+            for (auto &frame : stack) {
+                frame = previous + unzigzag(varint());
+                previous = frame;
+            }
+            stacks.push_back(std::move(stack));
+            break;
+        }
+        case STREAM_EXTENDED:
+            if (!extended(argument & 3, argument >> 2)) {
+                ok = false;
+                return false;
+            }
+            break;
+        case STREAM_SAMPLE: {
+            uint64_t ip_delta = varint();
+            uint64_t time_delta = varint();
+            uint64_t stack = varint();
+            if (!ok || argument >= threads.size() || stack > stacks.size()) {
+                ok = false;
+                return false;
+            }
+            ThreadState &state = threads[argument];
+            state.ip += unzigzag(ip_delta);
+            state.time += unzigzag(time_delta);
+
+            sample.pid = state.pid;
+            sample.tid = state.tid;
+            sample.ip = state.ip;
+            sample.time = state.time;
+            if (stack) {
+                sample.callchain = stacks[stack - 1];
+            } else {
+                sample.callchain.clear();
+            }
+            return true;
+        }
+        }
+    }
+    return false;
+}
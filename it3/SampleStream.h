@@ -0,0 +1,151 @@
+#ifndef SAMPLE_STREAM_H
+#define SAMPLE_STREAM_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <map>
+#include <unordered_map>
+#include <cstdint>
+#include "OffCpu.h"
+
+#define SAMPLE_STREAM_MAGIC 0x326c706d73666570ULL // "pefsmpl2"
+
+// Record kinds, in the low two bits of the first varint of a record
+enum StreamRecord : uint8_t {
+    STREAM_SAMPLE = 0,   // Thread index above the kind, zigzag IP delta, zigzag time delta, stack id + 1 (0: none)
+    STREAM_THREAD = 1,   // pid, tid of the next thread index
+    STREAM_STACK = 2,    // Depth above the kind, zigzag frame deltas, defines the next stack id
+    STREAM_EXTENDED = 3, // StreamExtended kind in the next two bits, its argument above them
+};
+
+// Strings are a varint length and the bytes
+enum StreamExtended : uint8_t {
+    STREAM_LOST = 0, // Lost sample count as the argument
+    STREAM_MMAP = 1, // pid, start, length, pgoff, build-id (binary), filename
+    STREAM_COMM = 2, // pid, tid, name
+    STREAM_FORK = 3, // pid, parent pid of a new process, which starts with the mappings of its parent
+};
+
+struct StreamSample {
+    uint32_t pid = 0, tid = 0;
+    uint64_t time = 0;
+    uint64_t ip = 0;
+    Stack callchain;
+};
+
+// A code mapping, so that samples can be symbolized after the process is gone
+// or on another host (by build-id)
+struct StreamMapping {
+    uint32_t pid = 0;
+    uint64_t start = 0, length = 0, pgoff = 0;
+    std::string build_id; // Hex, empty when the file has none
+    std::string filename;
+};
+
+struct StreamComm {
+    uint32_t pid = 0, tid = 0;
+    std::string name;
+};
+
+// Compact sample encoding: IPs and timestamps as deltas from the previous
+// sample of the same thread, varints throughout, and dictionaries for
+// threads and callchains so each is written once. Cheap enough to run in the
+// ring buffer drain loop; the buffer goes to the file (if any) in large
+// writes, without a path it stays in memory. MMAP and COMM records go in the
+// same stream, with the build-id of each mapped file read once per file.
+class SampleEncoder {
+public:
+    uint64_t samples = 0;
+    uint64_t raw_bytes = 0; // Size of the perf records encoded
+
+    explicit SampleEncoder(const std::string &path = "");
+    ~SampleEncoder();
+
+    SampleEncoder(const SampleEncoder &) = delete;
+    SampleEncoder &operator=(const SampleEncoder &) = delete;
+
+    void add(uint32_t pid, uint32_t tid, uint64_t time, uint64_t ip, const Stack &callchain, uint32_t raw_size);
+    void add_lost(uint64_t lost);
+    // Build-id is read from the file when the mapping has none
+    void add_mmap(const StreamMapping &mapping);
+    void add_comm(const StreamComm &comm);
+    void add_fork(uint32_t pid, uint32_t parent_pid);
+    void flush();
+
+    uint64_t bytes() const { return written + buffer.size(); }
+    const std::string &data() const { return buffer; } // Everything, when there is no file
+
+private:
+    struct ThreadState {
+        uint64_t ip = 0;
+        uint64_t time = 0;
+    };
+
+    struct StackHash {
+        size_t operator()(const Stack &stack) const {
+            uint64_t hash = 0xcbf29ce484222325ULL;
+            for (uint64_t frame : stack) {
+                hash = (hash ^ frame) * 0x100000001b3ULL;
+            }
+            return hash;
+        }
+    };
+
+    std::ofstream file;
+    std::string buffer;
+    uint64_t written = 0;
+    std::unordered_map<uint64_t, uint32_t> thread_index; // pid << 32 | tid
+    std::vector<ThreadState> threads;
+    std::unordered_map<Stack, uint32_t, StackHash> stack_ids;
+    std::unordered_map<std::string, std::string> build_ids; // Binary, by filename
+
+    void put_string(const std::string &value);
+};
+
+// Reads back what SampleEncoder wrote, from memory or from a file. Mapping
+// and comm records are collected as they are passed, so they are known for
+// every sample next() returns after them.
+class SampleDecoder {
+public:
+    uint64_t lost = 0;
+    std::vector<StreamMapping> mappings; // In stream order
+    std::vector<StreamComm> comms;
+
+    SampleDecoder(const char *data, size_t size);
+    // The file is mapped, not read, so recordings larger than memory decode too
+    explicit SampleDecoder(const std::string &path);
+    ~SampleDecoder();
+
+    SampleDecoder(const SampleDecoder &) = delete;
+    SampleDecoder &operator=(const SampleDecoder &) = delete;
+
+    bool valid() const { return ok; }
+    // False at the end of the stream or on a malformed record
+    bool next(StreamSample &sample);
+    // Latest mapping of the process containing ip, nullptr if none
+    const StreamMapping *find_mapping(uint32_t pid, uint64_t ip) const;
+
+private:
+    struct ThreadState {
+        uint32_t pid, tid;
+        uint64_t ip = 0;
+        uint64_t time = 0;
+    };
+
+    void *mapped = nullptr; // The file, when decoding one
+    size_t mapped_size = 0;
+    const uint8_t *p = nullptr;
+    const uint8_t *end = nullptr;
+    bool ok = false;
+    std::vector<ThreadState> threads;
+    std::vector<Stack> stacks;
+    std::unordered_map<uint32_t, std::map<uint64_t, size_t>> process_mappings; // Start -> index in mappings
+
+    void open(const char *data, size_t size);
+    uint64_t varint();
+    std::string string();
+    bool extended(uint64_t kind, uint64_t argument);
+};
+
+#endif // SAMPLE_STREAM_H
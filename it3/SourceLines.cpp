@@ -0,0 +1,775 @@
+#include "SourceLines.h"
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// DWARF constants, there is no dwarf.h to include
+#define DW_LNS_copy 1
+#define DW_LNS_advance_pc 2
+#define DW_LNS_advance_line 3
+#define DW_LNS_set_file 4
+#define DW_LNS_const_add_pc 8
+#define DW_LNS_fixed_advance_pc 9
+
+#define DW_LNE_end_sequence 1
+#define DW_LNE_set_address 2
+#define DW_LNE_define_file 3
+
+#define DW_LNCT_path 1
+#define DW_LNCT_directory_index 2
+
+#define DW_FORM_block 0x09
+#define DW_FORM_data1 0x0b
+#define DW_FORM_data2 0x05
+#define DW_FORM_data4 0x06
+#define DW_FORM_data8 0x07
+#define DW_FORM_data16 0x1e
+#define DW_FORM_string 0x08
+#define DW_FORM_strp 0x0e
+#define DW_FORM_udata 0x0f
+#define DW_FORM_line_strp 0x1f
+
+#define DEBUG_BUILD_ID_DIR "/usr/lib/debug/.build-id/"
+
+struct LineCacheHeader {
+    uint64_t magic;
+    uint32_t row_count;
+    uint32_t file_count;
+    uint32_t names_size;
+    uint32_t reserved;
+};
+
+// Bounds checked reader over a section, ok turns false on a truncated read
+struct Cursor {
+    const uint8_t *p;
+    const uint8_t *end;
+    bool ok = true;
+
+    Cursor(const uint8_t *p, const uint8_t *end) : p(p), end(end) {}
+
+    bool skip(uint64_t n) {
+        if (!ok || n > (uint64_t)(end - p)) {
+            ok = false;
+            p = end;
+            return false;
+        }
+        p += n;
+        return true;
+    }
+
+    uint64_t fixed(int size) {
+        uint64_t value = 0;
+        const uint8_t *start = p;
+        if (skip(size)) {
+            memcpy(&value, start, size); // Little endian only
+        }
+        return value;
+    }
+
+    uint8_t u8() { return fixed(1); }
+    uint16_t u16() { return fixed(2); }
+    uint32_t u32() { return fixed(4); }
+    uint64_t u64() { return fixed(8); }
+
+    uint64_t uleb() {
+        uint64_t value = 0;
+        for (int shift = 0; p < end; shift += 7) {
+            uint8_t byte = *p++;
+            if (shift < 64) {
+                value |= (uint64_t)(byte & 0x7f) << shift;
+            }
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+        ok = false;
+        return value;
+    }
+
+    int64_t sleb() {
+        int64_t value = 0;
+        int shift = 0;
+        while (p < end) {
+            uint8_t byte = *p++;
+            if (shift < 64) {
+                value |= (int64_t)(byte & 0x7f) << shift;
+            }
+            shift += 7;
+            if (!(byte & 0x80)) {
+                if (shift < 64 && (byte & 0x40)) {
+                    value |= -((int64_t)1 << shift);
+                }
+                return value;
+            }
+        }
+        ok = false;
+        return value;
+    }
+
+    const char *cstr() {
+        const uint8_t *nul = (const uint8_t *)memchr(p, 0, end - p);
+        if (!ok || nul == nullptr) {
+            ok = false;
+            p = end;
+            return "";
+        }
+        const char *value = (const char *)p;
+        p = nul + 1;
+        return value;
+    }
+};
+
+// A read-only mapping of an ELF64 little endian file
+class ElfFile {
+public:
+    explicit ElfFile(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size >= sizeof(Elf64_Ehdr)) {
+            void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                data = (const uint8_t *)addr;
+                size = st.st_size;
+            }
+        }
+        close(fd);
+
+        if (data && !valid()) {
+            munmap((void *)data, size);
+            data = nullptr;
+        }
+    }
+
+    ~ElfFile() {
+        if (data) {
+            munmap((void *)data, size);
+        }
+    }
+
+    ElfFile(const ElfFile &) = delete;
+    ElfFile &operator=(const ElfFile &) = delete;
+
+    bool is_open() const { return data != nullptr; }
+
+    const Elf64_Ehdr *header() const { return (const Elf64_Ehdr *)data; }
+
+    const Elf64_Phdr *program_header(int i) const {
+        return (const Elf64_Phdr *)(data + header()->e_phoff) + i;
+    }
+
+    const Elf64_Shdr *section_header(int i) const {
+        return (const Elf64_Shdr *)(data + header()->e_shoff) + i;
+    }
+
+    // Contents of a named section, false when missing, compressed or out of the file
+    bool section(const char *name, const uint8_t *&start, const uint8_t *&stop) const {
+        const Elf64_Ehdr *ehdr = header();
+        if (ehdr->e_shstrndx >= ehdr->e_shnum) {
+            return false;
+        }
+        const Elf64_Shdr *strtab = section_header(ehdr->e_shstrndx);
+        for (int i = 0; i < ehdr->e_shnum; ++i) {
+            const Elf64_Shdr *shdr = section_header(i);
+            if (shdr->sh_name >= strtab->sh_size || strcmp((const char *)data + strtab->sh_offset + shdr->sh_name, name) != 0) {
+                continue;
+            }
+            if (shdr->sh_type == SHT_NOBITS || (shdr->sh_flags & SHF_COMPRESSED) || !in_file(shdr->sh_offset, shdr->sh_size)) {
+                return false;
+            }
+            start = data + shdr->sh_offset;
+            stop = start + shdr->sh_size;
+            return true;
+        }
+        return false;
+    }
+
+    // NT_GNU_BUILD_ID from the PT_NOTE segments, as hex
+    std::string build_id() const {
+        for (int i = 0; i < header()->e_phnum; ++i) {
+            const Elf64_Phdr *phdr = program_header(i);
+            if (phdr->p_type != PT_NOTE || !in_file(phdr->p_offset, phdr->p_filesz)) {
+                continue;
+            }
+            Cursor notes(data + phdr->p_offset, data + phdr->p_offset + phdr->p_filesz);
+            while (notes.ok && notes.p < notes.end) {
+                uint32_t name_size = notes.u32(), desc_size = notes.u32(), type = notes.u32();
+                const uint8_t *name = notes.p;
+                notes.skip((name_size + 3) & ~3);
+                const uint8_t *desc = notes.p;
+                notes.skip((desc_size + 3) & ~3);
+                if (notes.ok && type == NT_GNU_BUILD_ID && name_size == 4 && memcmp(name, "GNU", 4) == 0) {
+                    std::string hex;
+                    char byte[3];
+                    for (uint32_t j = 0; j < desc_size; ++j) {
+                        snprintf(byte, sizeof(byte), "%02x", desc[j]);
+                        hex += byte;
+                    }
+                    return hex;
+                }
+            }
+        }
+        return "";
+    }
+
+private:
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+
+    bool in_file(uint64_t offset, uint64_t length) const {
+        return offset <= size && length <= size - offset;
+    }
+
+    bool valid() const {
+        const Elf64_Ehdr *ehdr = header();
+        return memcmp(ehdr->e_ident, ELFMAG, SELFMAG) == 0 && ehdr->e_ident[EI_CLASS] == ELFCLASS64
+               && ehdr->e_ident[EI_DATA] == ELFDATA2LSB
+               && in_file(ehdr->e_phoff, (uint64_t)ehdr->e_phnum * sizeof(Elf64_Phdr))
+               && in_file(ehdr->e_shoff, (uint64_t)ehdr->e_shnum * sizeof(Elf64_Shdr))
+               && (ehdr->e_shstrndx >= ehdr->e_shnum || in_file(section_header(ehdr->e_shstrndx)->sh_offset,
+                                                                section_header(ehdr->e_shstrndx)->sh_size));
+    }
+};
+
+// String sections that DWARF 5 file entries point into
+struct StringSections {
+    Cursor str{nullptr, nullptr};
+    Cursor line_str{nullptr, nullptr};
+
+    static const char *at(const Cursor &section, uint64_t offset) {
+        if (offset >= (uint64_t)(section.end - section.p)) {
+            return "";
+        }
+        const char *value = (const char *)section.p + offset;
+        return memchr(value, 0, section.end - section.p - offset) ? value : "";
+    }
+};
+
+// Reads one attribute of a DWARF 5 directory or file entry, strings into text and constants into number
+static bool read_form(Cursor &cursor, uint64_t form, bool dwarf64, const StringSections &strings, std::string &text, uint64_t &number) {
+    switch (form) {
+    case DW_FORM_string: text = cursor.cstr(); break;
+    case DW_FORM_line_strp: text = StringSections::at(strings.line_str, cursor.fixed(dwarf64 ? 8 : 4)); break;
+    case DW_FORM_strp: text = StringSections::at(strings.str, cursor.fixed(dwarf64 ? 8 : 4)); break;
+    case DW_FORM_udata: number = cursor.uleb(); break;
+    case DW_FORM_data1: number = cursor.u8(); break;
+    case DW_FORM_data2: number = cursor.u16(); break;
+    case DW_FORM_data4: number = cursor.u32(); break;
+    case DW_FORM_data8: number = cursor.u64(); break;
+    case DW_FORM_data16: cursor.skip(16); break;
+    case DW_FORM_block: cursor.skip(cursor.uleb()); break;
+    default: return false; // strx forms would need .debug_str_offsets
+    }
+    return cursor.ok;
+}
+
+// DWARF 5 directory and file name tables: a format description, then the entries
+static bool read_entries(Cursor &cursor, bool dwarf64, const StringSections &strings, std::vector<std::pair<std::string, uint64_t>> &entries) {
+    uint8_t format_count = cursor.u8();
+    std::vector<std::pair<uint64_t, uint64_t>> format; // Content type, form
+    for (int i = 0; i < format_count; ++i) {
+        uint64_t type = cursor.uleb();
+        format.push_back({type, cursor.uleb()});
+    }
+
+    uint64_t count = cursor.uleb();
+    for (uint64_t i = 0; i < count && cursor.ok; ++i) {
+        std::string path;
+        uint64_t directory = 0;
+        for (const auto &[type, form] : format) {
+            std::string text;
+            uint64_t number = 0;
+            if (!read_form(cursor, form, dwarf64, strings, text, number)) {
+                return false;
+            }
+            if (type == DW_LNCT_path) {
+                path = text;
+            } else if (type == DW_LNCT_directory_index) {
+                directory = number;
+            }
+        }
+        entries.push_back({path, directory});
+    }
+    return cursor.ok;
+}
+
+static std::string join_path(const std::vector<std::string> &directories, uint64_t directory, const std::string &name) {
+    if (name.empty() || name[0] == '/' || directory >= directories.size() || directories[directory].empty()) {
+        return name;
+    }
+    return directories[directory] + "/" + name;
+}
+
+// Runs the line number programs of .debug_line, appending rows with file ids into files
+static void decode_debug_line(const ElfFile &elf, std::vector<LineRow> &rows, std::vector<std::string> &files) {
+    const uint8_t *start, *stop;
+    if (!elf.section(".debug_line", start, stop)) {
+        return;
+    }
+
+    StringSections strings;
+    const uint8_t *str_start, *str_stop;
+    if (elf.section(".debug_str", str_start, str_stop)) {
+        strings.str = Cursor(str_start, str_stop);
+    }
+    if (elf.section(".debug_line_str", str_start, str_stop)) {
+        strings.line_str = Cursor(str_start, str_stop);
+    }
+
+    std::unordered_map<std::string, uint32_t> file_ids;
+    auto file_id = [&](const std::string &name) {
+        auto it = file_ids.find(name);
+        if (it != file_ids.end()) {
+            return it->second;
+        }
+        uint32_t id = files.size();
+        file_ids[name] = id;
+        files.push_back(name);
+        return id;
+    };
+
+    Cursor section(start, stop);
+    while (section.ok && section.p < section.end) {
+        // Unit header
+        bool dwarf64 = false;
+        uint64_t unit_length = section.u32();
+        if (unit_length == 0xffffffff) {
+            dwarf64 = true;
+            unit_length = section.u64();
+        }
+        if (!section.ok || unit_length > (uint64_t)(section.end - section.p)) {
+            break;
+        }
+        Cursor unit(section.p, section.p + unit_length);
+        section.skip(unit_length);
+
+        uint16_t version = unit.u16();
+        if (version < 2 || version > 5) {
+            continue;
+        }
+        if (version >= 5) {
+            unit.u8(); // address_size
+            unit.u8(); // segment_selector_size
+        }
+        uint64_t header_length = unit.fixed(dwarf64 ? 8 : 4);
+        if (header_length > (uint64_t)(unit.end - unit.p)) {
+            continue;
+        }
+        const uint8_t *program = unit.p + header_length;
+
+        uint8_t min_instruction_length = unit.u8();
+        if (version >= 4) {
+            unit.u8(); // maximum_operations_per_instruction, VLIW only
+        }
+        unit.u8(); // default_is_stmt
+        int8_t line_base = unit.u8();
+        uint8_t line_range = unit.u8();
+        uint8_t opcode_base = unit.u8();
+        std::vector<uint8_t> opcode_lengths(opcode_base > 0 ? opcode_base - 1 : 0);
+        for (auto &length : opcode_lengths) {
+            length = unit.u8();
+        }
+        if (!unit.ok || line_range == 0) {
+            continue;
+        }
+
+        // File entries to module file ids, DWARF 5 numbers files from 0 and earlier versions from 1
+        std::vector<std::string> directories;
+        std::vector<uint32_t> unit_files;
+        if (version >= 5) {
+            std::vector<std::pair<std::string, uint64_t>> entries;
+            if (!read_entries(unit, dwarf64, strings, entries)) {
+                continue;
+            }
+            for (const auto &entry : entries) {
+                directories.push_back(entry.first);
+            }
+            entries.clear();
+            if (!read_entries(unit, dwarf64, strings, entries)) {
+                continue;
+            }
+            for (const auto &[name, directory] : entries) {
+                unit_files.push_back(file_id(join_path(directories, directory, name)));
+            }
+        } else {
+            directories.push_back(""); // The compilation directory is only in .debug_info
+            while (unit.ok) {
+                std::string directory = unit.cstr();
+                if (directory.empty()) {
+                    break;
+                }
+                directories.push_back(directory);
+            }
+            unit_files.push_back(file_id("[unknown]"));
+            while (unit.ok) {
+                std::string name = unit.cstr();
+                if (name.empty()) {
+                    break;
+                }
+                uint64_t directory = unit.uleb();
+                unit.uleb(); // Modification time
+                unit.uleb(); // Length
+                unit_files.push_back(file_id(join_path(directories, directory, name)));
+            }
+        }
+
+        // Line number program
+        unit.p = program;
+        std::vector<LineRow> sequence;
+        uint64_t address = 0, file = version >= 5 ? 0 : 1;
+        int64_t line = 1;
+        auto emit = [&](uint32_t row_line) {
+            uint32_t id = file < unit_files.size() ? unit_files[file] : file_id("[unknown]");
+            sequence.push_back({address, id, row_line});
+        };
+
+        while (unit.ok && unit.p < unit.end) {
+            uint8_t opcode = unit.u8();
+            if (opcode >= opcode_base) {
+                // Special opcode: advance address and line, then append a row
+                uint8_t adjusted = opcode - opcode_base;
+                address += (adjusted / line_range) * min_instruction_length;
+                line += line_base + adjusted % line_range;
+                emit(line);
+                continue;
+            }
+
+            switch (opcode) {
+            case 0: { // Extended opcode
+                uint64_t length = unit.uleb();
+                const uint8_t *next = unit.p + std::min<uint64_t>(length, unit.end - unit.p);
+                uint8_t extended = length ? unit.u8() : 0;
+                if (extended == DW_LNE_end_sequence) {
+                    emit(0);
+                    // Sequences of functions the linker discarded start at 0 (or a tombstone)
+                    if (sequence.front().address != 0 && sequence.front().address < (uint64_t)-2) {
+                        rows.insert(rows.end(), sequence.begin(), sequence.end());
+                    }
+                    sequence.clear();
+                    address = 0;
+                    file = version >= 5 ? 0 : 1;
+                    line = 1;
+                } else if (extended == DW_LNE_set_address) {
+                    address = unit.fixed(std::min<uint64_t>(length - 1, 8));
+                } else if (extended == DW_LNE_define_file) {
+                    std::string name = unit.cstr();
+                    uint64_t directory = unit.uleb();
+                    unit_files.push_back(file_id(join_path(directories, directory, name)));
+                }
+                unit.p = next;
+                break;
+            }
+            case DW_LNS_copy:
+                emit(line);
+                break;
+            case DW_LNS_advance_pc:
+                address += unit.uleb() * min_instruction_length;
+                break;
+            case DW_LNS_advance_line:
+                line += unit.sleb();
+                break;
+            case DW_LNS_set_file:
+                file = unit.uleb();
+                break;
+            case DW_LNS_const_add_pc:
+                address += ((255 - opcode_base) / line_range) * min_instruction_length;
+                break;
+            case DW_LNS_fixed_advance_pc:
+                address += unit.u16();
+                break;
+            default:
+                // Column, is_stmt, basic block, prologue and epilogue markers, ISA: operands only
+                for (int i = 0; i < opcode_lengths[opcode - 1]; ++i) {
+                    unit.uleb();
+                }
+                break;
+            }
+        }
+    }
+}
+
+// Rows sorted by address, one row per address and no row repeating the previous (file, line)
+static void compact_rows(std::vector<LineRow> &rows) {
+    // An end of sequence sorts before a sequence starting at the same address, the last row of an address wins
+    std::stable_sort(rows.begin(), rows.end(), [](const LineRow &a, const LineRow &b) {
+        if (a.address != b.address) {
+            return a.address < b.address;
+        }
+        return a.line == 0 && b.line != 0;
+    });
+
+    std::vector<LineRow> compacted;
+    for (size_t i = 0; i < rows.size(); ++i) {
+        if (i + 1 < rows.size() && rows[i + 1].address == rows[i].address) {
+            continue;
+        }
+        if (!compacted.empty() && compacted.back().file == rows[i].file && compacted.back().line == rows[i].line) {
+            continue;
+        }
+        compacted.push_back(rows[i]);
+    }
+    rows.swap(compacted);
+}
+
+static std::string serialize(const std::vector<LineRow> &rows, const std::vector<std::string> &files) {
+    std::vector<uint32_t> offsets;
+    std::string names;
+    for (const auto &file : files) {
+        offsets.push_back(names.size());
+        names += file;
+        names += '\0';
+    }
+
+    LineCacheHeader header = {LINE_CACHE_MAGIC, (uint32_t)rows.size(), (uint32_t)files.size(), (uint32_t)names.size(), 0};
+    std::string data((const char *)&header, sizeof(header));
+    data.append((const char *)rows.data(), rows.size() * sizeof(LineRow));
+    data.append((const char *)offsets.data(), offsets.size() * sizeof(uint32_t));
+    data += names;
+    return data;
+}
+
+// mkdir -p
+static bool make_directories(const std::string &path) {
+    for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+        std::string prefix = path.substr(0, slash);
+        if (mkdir(prefix.c_str(), 0755) == -1 && errno != EEXIST) {
+            return false;
+        }
+        if (slash == std::string::npos) {
+            return true;
+        }
+    }
+}
+
+// Written next to the final name and renamed, a concurrent reader never sees a partial file
+static void write_cache(const std::string &cache_path, const std::string &data) {
+    size_t slash = cache_path.rfind('/');
+    if (slash == std::string::npos || !make_directories(cache_path.substr(0, slash))) {
+        return;
+    }
+
+    std::string temporary = cache_path + "." + std::to_string(getpid());
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return;
+    }
+    bool written = write(fd, data.data(), data.size()) == (ssize_t)data.size();
+    close(fd);
+    if (!written || rename(temporary.c_str(), cache_path.c_str()) == -1) {
+        unlink(temporary.c_str());
+    }
+}
+
+bool LineTable::attach(const char *data, size_t size) {
+    if (size < sizeof(LineCacheHeader)) {
+        return false;
+    }
+    LineCacheHeader header;
+    memcpy(&header, data, sizeof(header));
+    size_t expected = sizeof(header) + (size_t)header.row_count * sizeof(LineRow) + (size_t)header.file_count * sizeof(uint32_t) + header.names_size;
+    if (header.magic != LINE_CACHE_MAGIC || size != expected || (header.names_size && data[size - 1] != '\0')) {
+        return false;
+    }
+
+    row_data = (const LineRow *)(data + sizeof(header));
+    row_count = header.row_count;
+    file_offsets = (const uint32_t *)(row_data + row_count);
+    file_count = header.file_count;
+    names = (const char *)(file_offsets + file_count);
+    for (uint32_t i = 0; i < file_count; ++i) {
+        if (file_offsets[i] >= header.names_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::unique_ptr<LineTable> LineTable::load(const std::string &path, const std::string &cache_dir) {
+    ElfFile elf(path);
+    if (!elf.is_open()) {
+        return nullptr;
+    }
+
+    std::unique_ptr<LineTable> table(new LineTable());
+    table->path = path;
+    table->build_id = elf.build_id();
+    for (int i = 0; i < elf.header()->e_phnum; ++i) {
+        const Elf64_Phdr *phdr = elf.program_header(i);
+        if (phdr->p_type == PT_LOAD) {
+            table->segments.push_back({phdr->p_offset, phdr->p_filesz, phdr->p_vaddr});
+        }
+    }
+
+    // A table decoded by an earlier run
+    std::string cache_path;
+    if (!table->build_id.empty() && !cache_dir.empty()) {
+        cache_path = cache_dir + "/" + table->build_id + ".lines";
+        int fd = open(cache_path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                table->mapped = addr;
+                table->mapped_size = st.st_size;
+                table->from_cache = table->attach((const char *)addr, st.st_size);
+            }
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        if (table->from_cache) {
+            if (table->row_count == 0) {
+                return nullptr;
+            }
+            return table;
+        }
+        if (table->mapped) {
+            munmap(table->mapped, table->mapped_size);
+            table->mapped = nullptr;
+        }
+    }
+
+    // Stripped modules may have their debug information installed separately
+    std::vector<LineRow> rows;
+    std::vector<std::string> files;
+    decode_debug_line(elf, rows, files);
+    if (rows.empty() && table->build_id.size() > 2) {
+        ElfFile debug(DEBUG_BUILD_ID_DIR + table->build_id.substr(0, 2) + "/" + table->build_id.substr(2) + ".debug");
+        if (debug.is_open()) {
+            decode_debug_line(debug, rows, files);
+        }
+    }
+    compact_rows(rows);
+
+    // Modules without line information are cached too, as empty tables
+    table->owned = serialize(rows, files);
+    if (!cache_path.empty()) {
+        write_cache(cache_path, table->owned);
+    }
+    if (rows.empty() || !table->attach(table->owned.data(), table->owned.size())) {
+        return nullptr;
+    }
+    return table;
+}
+
+LineTable::~LineTable() {
+    if (mapped) {
+        munmap(mapped, mapped_size);
+    }
+}
+
+bool LineTable::lookup(uint64_t file_offset, const char *&file, uint32_t &line) const {
+    // The virtual address the module was linked for
+    uint64_t address = 0;
+    bool found = false;
+    for (const auto &segment : segments) {
+        if (file_offset >= segment.offset && file_offset - segment.offset < segment.size) {
+            address = file_offset - segment.offset + segment.vaddr;
+            found = true;
+            break;
+        }
+    }
+    if (!found) {
+        return false;
+    }
+
+    const LineRow *it = std::upper_bound(row_data, row_data + row_count, address,
+                                         [](uint64_t value, const LineRow &row) { return value < row.address; });
+    if (it == row_data || (it - 1)->line == 0 || (it - 1)->file >= file_count) {
+        return false;
+    }
+    --it;
+    file = names + file_offsets[it->file];
+    line = it->line;
+    return true;
+}
+
+std::string elf_build_id(const std::string &path) {
+    ElfFile elf(path);
+    return elf.is_open() ? elf.build_id() : "";
+}
+
+SourceLineTracker::SourceLineTracker(const std::string &cache_dir) : cache_dir(cache_dir) {}
+
+std::string SourceLineTracker::default_cache_dir() {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    if (xdg && xdg[0] == '/') {
+        return std::string(xdg) + "/perf_monitor/lines";
+    }
+    const char *home = getenv("HOME");
+    if (home && home[0] == '/') {
+        return std::string(home) + "/.cache/perf_monitor/lines";
+    }
+    return "";
+}
+
+void SourceLineTracker::on_mmap(uint64_t addr, uint64_t len, uint64_t pgoff, const std::string &filename) {
+    mappings[addr] = {addr + len, pgoff, filename};
+}
+
+const LineTable *SourceLineTracker::table(const std::string &path) {
+    auto it = tables.find(path);
+    if (it == tables.end()) {
+        // [vdso], //anon and friends are not files
+        it = tables.emplace(path, path.empty() || path[0] != '/' || path.rfind("/memfd:", 0) == 0 ? nullptr
+                                                                                                 : LineTable::load(path, cache_dir)).first;
+    }
+    return it->second.get();
+}
+
+void SourceLineTracker::print(const std::unordered_map<uint64_t, int> &ip_histogram, size_t max_lines) {
+    std::map<std::pair<std::string, uint32_t>, uint64_t> line_samples;
+    uint64_t total = 0, resolved = 0;
+
+    for (const auto &[ip, samples] : ip_histogram) {
+        total += samples;
+        auto it = mappings.upper_bound(ip);
+        if (it == mappings.begin() || ip >= std::prev(it)->second.end) {
+            continue;
+        }
+        --it;
+        const LineTable *lines = table(it->second.filename);
+        const char *file;
+        uint32_t line;
+        if (lines && lines->lookup(ip - it->first + it->second.pgoff, file, line)) {
+            line_samples[{file, line}] += samples;
+            resolved += samples;
+        }
+    }
+
+    std::cout << "\nLine tables:\n";
+    for (const auto &[path, lines] : tables) {
+        if (lines) {
+            std::cout << "  " << path << ": " << lines->rows() << " rows" << (lines->from_cache ? ", cached" : "")
+                      << (lines->build_id.empty() ? ", no build-id" : "") << "\n";
+        } else if (!path.empty() && path[0] == '/') {
+            std::cout << "  " << path << ": no line information\n";
+        }
+    }
+
+    std::vector<std::pair<uint64_t, std::pair<std::string, uint32_t>>> sorted;
+    for (const auto &[location, samples] : line_samples) {
+        sorted.push_back({samples, location});
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+
+    std::streamsize precision = std::cout.precision();
+    std::cout << "\nSamples per source line (" << resolved << " of " << total << " samples resolved):\n";
+    std::cout << std::fixed << std::setprecision(1);
+    for (size_t i = 0; i < sorted.size() && i < max_lines; ++i) {
+        const auto &[samples, location] = sorted[i];
+        std::cout << std::setw(10) << samples << std::setw(8) << 100.0 * samples / total << "%  "
+                  << location.first << ":" << location.second << "\n";
+    }
+    std::cout.unsetf(std::ios::fixed);
+    std::cout.precision(precision);
+}
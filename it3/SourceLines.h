@@ -0,0 +1,92 @@
+#ifndef SOURCE_LINES_H
+#define SOURCE_LINES_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+
+#define LINE_CACHE_MAGIC 0x31656e696c666570ULL // "pefline1"
+
+// One row of a line table, covering the addresses up to the next row.
+// Line 0 marks the end of a sequence, addresses without line information.
+struct LineRow {
+    uint64_t address;
+    uint32_t file;
+    uint32_t line;
+};
+
+// Address -> (file, line) table of one ELF module, decoded from .debug_line
+// (DWARF 2 to 5) of the module or of its /usr/lib/debug/.build-id file.
+// Tables of modules with a build-id are cached on disk as
+//     header, rows sorted by address, file name offsets, file names
+// and later runs mmap the cache instead of decoding again.
+class LineTable {
+public:
+    std::string path;
+    std::string build_id; // Hex, empty when the module has none
+    bool from_cache = false;
+
+    // nullptr when the module is not an ELF file or has no line information
+    static std::unique_ptr<LineTable> load(const std::string &path, const std::string &cache_dir);
+    ~LineTable();
+
+    LineTable(const LineTable &) = delete;
+    LineTable &operator=(const LineTable &) = delete;
+
+    // Offset in the module file, as in the pgoff of the MMAP record
+    bool lookup(uint64_t file_offset, const char *&file, uint32_t &line) const;
+    uint32_t rows() const { return row_count; }
+
+private:
+    struct Segment {
+        uint64_t offset, size, vaddr;
+    };
+
+    std::vector<Segment> segments; // PT_LOAD, file offset -> virtual address
+    void *mapped = nullptr;        // The cache file, or
+    size_t mapped_size = 0;
+    std::string owned;             // the serialized table when there is no build-id
+    const LineRow *row_data = nullptr;
+    uint32_t row_count = 0;
+    const uint32_t *file_offsets = nullptr;
+    uint32_t file_count = 0;
+    const char *names = nullptr;
+
+    LineTable() = default;
+    bool attach(const char *data, size_t size);
+};
+
+// NT_GNU_BUILD_ID of an ELF file as hex, empty when it has none or is not ELF
+std::string elf_build_id(const std::string &path);
+
+// Source line attribution: remembers the MMAP records and, once the run is
+// over, reports the samples of the IP histogram per source line. Modules are
+// only opened for the report, the drain loop just records mappings.
+class SourceLineTracker {
+public:
+    explicit SourceLineTracker(const std::string &cache_dir = default_cache_dir());
+
+    void on_mmap(uint64_t addr, uint64_t len, uint64_t pgoff, const std::string &filename);
+    void print(const std::unordered_map<uint64_t, int> &ip_histogram, size_t max_lines = 30);
+
+    // $XDG_CACHE_HOME/perf_monitor/lines or ~/.cache/perf_monitor/lines, empty for no cache
+    static std::string default_cache_dir();
+
+private:
+    struct Mapping {
+        uint64_t end;
+        uint64_t pgoff;
+        std::string filename;
+    };
+
+    std::string cache_dir;
+    std::map<uint64_t, Mapping> mappings;
+    std::unordered_map<std::string, std::unique_ptr<LineTable>> tables; // By path, nullptr without line information
+
+    const LineTable *table(const std::string &path);
+};
+
+#endif // SOURCE_LINES_H
@@ -0,0 +1,314 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "utils.h"
+#include "prof_region.h"
+#include "JitSymbols.h"
+
+// Synthetic workloads used by perf_bench to measure the profiler overhead.
+// Every workload does a fixed amount of work, so wall time is comparable
+// between runs with and without profiling.
+
+// Plain arithmetic, no syscalls
+static uint64_t spin(uint64_t iterations) {
+    volatile uint64_t acc = 0;
+    for (uint64_t i = 0; i < iterations; ++i) {
+        acc = acc * 6364136223846793005ULL + i;
+    }
+    return acc;
+}
+
+static void tight_loop(int scale) {
+    spin(200000000ULL * scale);
+}
+
+// Many short lived processes, each one causes FORK handling in perf_monitor
+static void fork_storm(int scale) {
+    for (int i = 0; i < 200 * scale; ++i) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            error_and_exit("fork");
+        }
+        if (pid == 0) {
+            spin(200000);
+            _exit(0);
+        }
+        waitpid(pid, nullptr, 0);
+    }
+}
+
+// Executable file mappings, the same thing dlopen does, each one is a MMAP record
+static void mmap_storm(int scale) {
+    int fd = open("/proc/self/exe", O_RDONLY);
+    if (fd == -1) {
+        error_and_exit("open");
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    for (int i = 0; i < 20000 * scale; ++i) {
+        void *addr = mmap(NULL, page, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            error_and_exit("mmap");
+        }
+        munmap(addr, page);
+        spin(2000);
+    }
+    close(fd);
+}
+
+// Many threads sharing the work of tight_loop
+static void many_threads(int scale) {
+    const int thread_count = 32;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_count; ++i) {
+        threads.emplace_back([scale]() { spin(200000000ULL * scale / thread_count); });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+// Application phases marked with prof_region.h, for perf_monitor -regions
+static void phases(int scale) {
+    for (int i = 0; i < 1000 * scale; ++i) {
+        PROF_REGION("request");
+        {
+            PROF_REGION("parse");
+            spin(20000);
+        }
+        {
+            PROF_REGION("plan");
+            spin(40000);
+        }
+        {
+            PROF_REGION("execute");
+            spin(120000);
+        }
+        spin(20000);
+    }
+}
+
+// Mostly blocked in sleep and in a pipe read, for perf_monitor -offcpu
+static void blocking(int scale) {
+    int pipefd[2];
+    if (pipe(pipefd) == -1) {
+        error_and_exit("pipe");
+    }
+    std::thread writer([&]() {
+        for (int i = 0; i < 20 * scale; ++i) {
+            usleep(5000);
+            if (write(pipefd[1], "", 1) != 1) {
+                error_and_exit("write");
+            }
+        }
+    });
+    char buffer;
+    for (int i = 0; i < 20 * scale; ++i) {
+        if (read(pipefd[0], &buffer, 1) != 1) {
+            error_and_exit("read");
+        }
+        spin(1000000);
+    }
+    writer.join();
+    close(pipefd[0]);
+    close(pipefd[1]);
+}
+
+// Touches fresh heap and anonymous memory page by page, for perf_monitor -mem
+static void page_touch(int scale) {
+    const size_t size = 64 << 20;
+    long page = sysconf(_SC_PAGESIZE);
+    for (int i = 0; i < scale; ++i) {
+        std::vector<char> heap(size / 4);
+        char *anon = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (anon == MAP_FAILED) {
+            error_and_exit("mmap");
+        }
+        for (size_t offset = 0; offset < size; offset += page) {
+            anon[offset] = 1;
+        }
+        for (size_t offset = 0; offset < heap.size(); offset += page) {
+            heap[offset] = 1;
+        }
+        munmap(anon, size);
+    }
+}
+
+#if defined(__x86_64__)
+// uint64_t hot_loop(uint64_t n): n rounds of acc = acc * multiplier + i
+#define HOT_LOOP_SIZE 25
+
+static void emit_hot_loop(uint8_t *code, uint8_t multiplier) {
+    const uint8_t bytes[HOT_LOOP_SIZE] = {
+        0x31, 0xc0,                   // xor eax, eax
+        0x31, 0xc9,                   // xor ecx, ecx
+        0x48, 0x85, 0xff,             // test rdi, rdi
+        0x74, 0x0f,                   // je done
+        0x48, 0x6b, 0xc0, multiplier, // loop: imul rax, rax, multiplier
+        0x48, 0x01, 0xc8,             // add rax, rcx
+        0x48, 0xff, 0xc1,             // inc rcx
+        0x48, 0x39, 0xf9,             // cmp rcx, rdi
+        0x75, 0xf1,                   // jne loop
+        0xc3,                         // done: ret
+    };
+    memcpy(code, bytes, sizeof(bytes));
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Symbols the way runtimes publish them, a perf map or a jitdump. The file is
+// removed on exit, perf_monitor keeps reading it through its open descriptor.
+class JitSymbolWriter {
+public:
+    explicit JitSymbolWriter(bool jitdump) {
+        path = (jitdump ? "/tmp/jit-" : "/tmp/perf-") + std::to_string(getpid()) + (jitdump ? ".dump" : ".map");
+        fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            error_and_exit("open " + path);
+        }
+        if (!jitdump) {
+            return;
+        }
+
+        struct { uint32_t magic, version, total_size, elf_mach, pad1, pid; uint64_t timestamp, flags; } header = {
+            JITDUMP_MAGIC, 1, sizeof(header), 62 /* EM_X86_64 */, 0, (uint32_t)getpid(), monotonic_ns(), 0};
+        write_all(&header, sizeof(header));
+
+        // perf_monitor learns about the file from the MMAP record of an executable mapping
+        int read_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        marker = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, read_fd, 0);
+        if (marker == MAP_FAILED) {
+            error_and_exit("mmap " + path);
+        }
+        close(read_fd);
+    }
+
+    ~JitSymbolWriter() {
+        if (marker) {
+            munmap(marker, sysconf(_SC_PAGESIZE));
+        }
+        close(fd);
+        unlink(path.c_str());
+    }
+
+    void code_load(const uint8_t *code, uint64_t size, const std::string &name) {
+        if (!marker) {
+            char line[256];
+            int length = snprintf(line, sizeof(line), "%lx %lx %s\n", (unsigned long)code, (unsigned long)size, name.c_str());
+            write_all(line, length);
+            return;
+        }
+
+        struct { uint32_t id, total_size; uint64_t timestamp; } record;
+        struct { uint32_t pid, tid; uint64_t vma, code_addr, code_size, code_index; } load = {
+            (uint32_t)getpid(), (uint32_t)syscall(SYS_gettid), (uint64_t)code, (uint64_t)code, size, code_index++};
+        record.id = JIT_CODE_LOAD;
+        record.total_size = sizeof(record) + sizeof(load) + name.size() + 1 + size;
+        record.timestamp = monotonic_ns();
+        write_all(&record, sizeof(record));
+        write_all(&load, sizeof(load));
+        write_all(name.c_str(), name.size() + 1);
+        write_all(code, size);
+    }
+
+private:
+    std::string path;
+    int fd;
+    void *marker = nullptr;
+    uint64_t code_index = 0;
+
+    void write_all(const void *data, size_t size) {
+        if (write(fd, data, size) != (ssize_t)size) {
+            error_and_exit("write");
+        }
+    }
+};
+
+// A tiny JIT for perf_monitor -jit: compiles a hot loop into anonymous
+// executable memory and runs it, then compiles a second version over the
+// same address (re-JIT) and runs that. Each version should get half of the
+// samples under its own name.
+static volatile uint64_t jit_sink; // Keeps the calls
+
+static int jit(int scale, bool jitdump) {
+    long page = sysconf(_SC_PAGESIZE);
+    uint8_t *code = (uint8_t *)mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        error_and_exit("mmap");
+    }
+    JitSymbolWriter symbols(jitdump);
+
+    uint64_t result = 0;
+    const uint8_t multipliers[] = {13, 7};
+    for (int version = 0; version < 2; ++version) {
+        if (mprotect(code, page, PROT_READ | PROT_WRITE) == -1) {
+            error_and_exit("mprotect");
+        }
+        emit_hot_loop(code, multipliers[version]);
+        if (mprotect(code, page, PROT_READ | PROT_EXEC) == -1) {
+            error_and_exit("mprotect");
+        }
+        symbols.code_load(code, HOT_LOOP_SIZE, "jit_hot_loop_v" + std::to_string(version + 1));
+
+        uint64_t (*hot_loop)(uint64_t) = (uint64_t (*)(uint64_t))code;
+        result += hot_loop(200000000ULL * scale);
+    }
+
+    munmap(code, page);
+    jit_sink = result;
+    return 0;
+}
+#else
+static int jit(int, bool) {
+    std::cerr << "The jit workload emits x86-64 code.\n";
+    return 1;
+}
+#endif
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " loop|fork|mmap|threads|phases|blocking|pages|jit|jitdump [scale]\n";
+        return 1;
+    }
+
+    int scale = argc > 2 ? std::atoi(argv[2]) : 1;
+    if (scale <= 0) {
+        std::cerr << "Invalid scale.\n";
+        return 1;
+    }
+
+    if (strcmp(argv[1], "loop") == 0) {
+        tight_loop(scale);
+    } else if (strcmp(argv[1], "fork") == 0) {
+        fork_storm(scale);
+    } else if (strcmp(argv[1], "mmap") == 0) {
+        mmap_storm(scale);
+    } else if (strcmp(argv[1], "threads") == 0) {
+        many_threads(scale);
+    } else if (strcmp(argv[1], "phases") == 0) {
+        phases(scale);
+    } else if (strcmp(argv[1], "blocking") == 0) {
+        blocking(scale);
+    } else if (strcmp(argv[1], "pages") == 0) {
+        page_touch(scale);
+    } else if (strcmp(argv[1], "jit") == 0) {
+        return jit(scale, false);
+    } else if (strcmp(argv[1], "jitdump") == 0) {
+        return jit(scale, true);
+    } else {
+        std::cerr << "Unknown workload " << argv[1] << ".\n";
+        return 1;
+    }
+
+    return 0;
+}
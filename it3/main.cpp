@@ -9,34 +9,244 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <poll.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <sys/syscall.h>
 #include "PerfEvent.h"
+#include "Profile.h"
+#include "Regions.h"
+#include "OffCpu.h"
+#include "Memory.h"
+#include "SourceLines.h"
+#include "SampleStream.h"
+#include "JitSymbols.h"
+#include "Cgroup.h"
+#include "Export.h"
+#include "Interval.h"
+#include "FlightRecorder.h"
 #include "utils.h"
 #include <map>
+#include <memory>
 #include <unordered_map>
+#include <algorithm>
 
 
-std::unordered_map<std::string, int> global_histogram;
+ProfileData global_profile;
 
-std::map<uint64_t, std::pair<uint64_t, std::string>> global_mmap_records;
+// Set by SIGINT/SIGTERM, ends a cgroup session that has no command to wait for
+volatile sig_atomic_t stop_requested = 0;
 
-std::unordered_map<uint64_t, int> global_ip_histogram;
+void request_stop(int) {
+    stop_requested = 1;
+}
 
-void print_global_histogram() {
+// Set by SIGUSR2, takes a flight recorder snapshot
+volatile sig_atomic_t snapshot_requested = 0;
+
+void request_snapshot(int) {
+    snapshot_requested = 1;
+}
+
+// Flight recorder triggers are checked at least this often
+#define FLIGHT_POLL_MS 100
+
+void print_histogram(const ProfileData &profile) {
     std::cout << "Global histogram of frequently visited code sections and modules:\n";
-    for (const auto& entry : global_histogram) {
+    for (const auto& entry : profile.histogram) {
         std::cout << "Module: " << entry.first << ", Hits: " << entry.second << "\n";
     }
 
     std::cout << "\nGlobal histogram of frequently visited IP addresses:\n";
-    for (const auto& entry : global_ip_histogram) {
+    for (const auto& entry : profile.ip_histogram) {
         std::cout << "Address: 0x" << std::hex << entry.first << std::dec << ", Hits: " << entry.second << "\n";
     }
 }
 
+void print_global_histogram() {
+    print_histogram(global_profile);
+}
+
+// Cost of the profiler itself, parsed by perf_bench
+void print_profiler_stats() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    uint64_t cpu_us = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL
+                      + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+
+    std::cout << "Samples drained: " << global_profile.samples << "\n";
+    std::cout << "Lost samples: " << global_profile.lost << "\n";
+    std::cout << "Profiler CPU time: " << cpu_us / 1000.0 << " milliseconds\n";
+}
+
+
+// Aggregated samples as a pprof profile, with callchains when -offcpu recorded them
+void export_pprof(const std::string &path, const std::string &event_name, uint64_t sample_period, const OffCpuTracker *offcpu) {
+    PprofWriter writer(path, event_name, sample_period);
+    // pprof mappings have no pid, those of every process go into the one profile
+    for (const auto &[pid, records] : global_profile.mmap_records) {
+        for (const auto &[start, mapping] : records) {
+            writer.add_mapping(start, mapping.end, mapping.pgoff, mapping.filename);
+        }
+    }
+
+    if (offcpu) {
+        for (const auto &[stack, samples] : offcpu->oncpu_samples) {
+            writer.add_sample(stack.second, samples);
+        }
+    } else {
+        for (const auto &[ip, samples] : global_profile.ip_histogram) {
+            writer.add_sample({ip}, samples);
+        }
+    }
+}
+
+// A -o recording as pprof and/or a Chrome trace, one sample at a time: the stream is mapped, not read into
+// memory, and its mapping records are written to the profile as they are passed
+int export_stream(const std::string &stream_path, const std::string &pprof_path, const std::string &chrome_path,
+                  const std::string &event_name, uint64_t sample_period) {
+    SampleDecoder decoder(stream_path);
+    if (!decoder.valid()) {
+        std::cerr << "Not a sample stream: " << stream_path << "\n";
+        return 1;
+    }
+
+    std::unique_ptr<PprofWriter> pprof;
+    if (!pprof_path.empty()) {
+        pprof = std::make_unique<PprofWriter>(pprof_path, event_name, sample_period);
+    }
+    std::unique_ptr<ChromeTraceWriter> trace;
+    if (!chrome_path.empty()) {
+        trace = std::make_unique<ChromeTraceWriter>(chrome_path);
+    }
+
+    static const std::string unknown = "[unknown]";
+    StreamSample sample;
+    size_t mappings_written = 0;
+    uint64_t samples = 0;
+    while (decoder.next(sample)) {
+        samples++;
+        if (pprof) {
+            for (; mappings_written < decoder.mappings.size(); ++mappings_written) {
+                const StreamMapping &mapping = decoder.mappings[mappings_written];
+                pprof->add_mapping(mapping.start, mapping.start + mapping.length, mapping.pgoff, mapping.filename);
+            }
+            pprof->add_sample(sample.callchain.empty() ? Stack{sample.ip} : sample.callchain, 1);
+        }
+        if (trace) {
+            const StreamMapping *mapping = decoder.find_mapping(sample.pid, sample.ip);
+            trace->sample(sample.pid, sample.tid, sample.time, mapping ? mapping->filename : unknown, sample.ip);
+        }
+    }
+
+    std::cout << "Exported " << samples << " samples of " << stream_path << (decoder.valid() ? "" : " (truncated)")
+              << ", lost while recording: " << decoder.lost << "\n";
+    return 0;
+}
+
+// Profiles every process of the given cgroups with per-CPU events, until the command
+// (moved into the first cgroup) exits or until SIGINT/SIGTERM when there is no command
+int run_cgroups(const std::vector<std::string> &cgroup_paths, const std::string &count_event, const std::string &record_event,
+                uint64_t sample_period, uint64_t sample_type, std::vector<char*> &exec_args, int sleep_time) {
+    std::vector<std::unique_ptr<CgroupMonitor>> cgroups;
+    for (const auto &path : cgroup_paths) {
+        cgroups.push_back(std::make_unique<CgroupMonitor>(path, count_event, record_event, sample_period, sample_type));
+    }
+
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+
+    pid_t pid = -1;
+    if (exec_args.size() > 1) {
+        int pipefd[2];
+        if (pipe(pipefd) == -1) {
+            error_and_exit("pipe");
+        }
+
+        pid = fork();
+        if (pid == -1) {
+            error_and_exit("fork");
+        }
+
+        if (pid == 0) {  // Child process
+            close(pipefd[1]);
+            char buffer;
+            if (read(pipefd[0], &buffer, 1) != 1) {
+                error_and_exit("read");
+            }
+            close(pipefd[0]);
+            execvp(exec_args[0], exec_args.data());
+            error_and_exit("execvp");
+        }
+
+        close(pipefd[0]);
+        cgroups[0]->add_process(pid);
+        if (sleep_time > 0) {
+            sleep(sleep_time);
+        }
+        if (write(pipefd[1], "", 1) != 1) {
+            error_and_exit("write");
+        }
+        close(pipefd[1]);
+    } else {
+        std::cout << "Profiling until interrupted.\n";
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+
+    std::vector<struct pollfd> poll_fds;
+    for (auto &cgroup : cgroups) {
+        for (const auto &pair : cgroup->sampling_events) {
+            poll_fds.push_back({pair.first, POLLIN, 0});
+        }
+    }
+
+    // Per-CPU events never hang up, the session ends with the command or a signal
+    while (!stop_requested) {
+        int poll_result = poll(poll_fds.data(), poll_fds.size(), 100);
+        if (poll_result == -1 && errno != EINTR) {
+            error_and_exit("poll");
+        }
+
+        for (auto &cgroup : cgroups) {
+            cgroup->drain();
+        }
+
+        if (pid != -1 && waitpid(pid, nullptr, WNOHANG) == pid) {
+            break;
+        }
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin);
+    std::cout << "Elapsed time: " << elapsed_ms.count() << " milliseconds\n";
+
+    for (auto &cgroup : cgroups) {
+        cgroup->drain();
+
+        std::cout << "\nContainer " << cgroup->path << ":\n";
+        if (!count_event.empty()) {
+            std::cout << "Event count (" << count_event << ") for cgroup: " << cgroup->read_count() << "\n\n";
+        }
+        if (!record_event.empty()) {
+            print_histogram(cgroup->profile);
+            if (cgroup->memory) {
+                cgroup->memory->print();
+            }
+            std::cout << "Container samples: " << cgroup->profile.samples << ", lost: " << cgroup->profile.lost << "\n";
+        }
+
+        global_profile.samples += cgroup->profile.samples;
+        global_profile.lost += cgroup->profile.lost;
+    }
+
+    print_profiler_stats();
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
     if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " [-time <time>] [-count <event>] [-record <event:period>] command arg1 arg2 ...\n";
+        std::cerr << "Usage: " << argv[0] << " [-time <time>] [-count <event>] [-record <event:period>] [-regions] [-offcpu] [-mem] [-G <cgroup>] [-pprof <file>] [-chrome <file>] [-I <ms>] [-Io <file>] [-lines] [-o <file>] [-F <seconds>] [-Fo <prefix>] [-Ft <seconds>] [-Fc <name>><limit>] [-jit] command arg1 arg2 ...\n"
+                  << "       " << argv[0] << " -export <stream> [-record <event:period>] [-pprof <file>] [-chrome <file>]\n";
         return 1;
     }
 
@@ -48,6 +258,24 @@ int main(int argc, char *argv[]) {
     bool time_set = false;
     bool count_set = false;
     bool record_set = false;
+    bool regions_set = false;
+    bool offcpu_set = false;
+    bool mem_set = false;
+    std::vector<std::string> cgroup_paths;
+    std::string pprof_path;
+    std::string chrome_path;
+    uint64_t interval_ms = 0;
+    std::string interval_path;
+    bool lines_set = false;
+    std::string stream_path;
+    double flight_seconds = 0;
+    std::string flight_prefix = "flight";
+    double flight_timeout = 0;
+    std::string flight_threshold;
+    std::string threshold_name;
+    double threshold_limit = 0;
+    bool jit_set = false;
+    std::string export_path;
 
     // Parse command line arguments
     for (int i = 1; i < argc; ++i) {
@@ -75,13 +303,68 @@ int main(int argc, char *argv[]) {
                 return 1;
             }
             record_set = true;
+        } else if (strcmp(argv[i], "-regions") == 0) {
+            regions_set = true;
+        } else if (strcmp(argv[i], "-offcpu") == 0) {
+            offcpu_set = true;
+        } else if (strcmp(argv[i], "-mem") == 0) {
+            mem_set = true;
+        } else if (strcmp(argv[i], "-G") == 0 && i + 1 < argc) {
+            cgroup_paths.push_back(argv[++i]);
+        } else if (strcmp(argv[i], "-pprof") == 0 && i + 1 < argc) {
+            pprof_path = argv[++i];
+        } else if (strcmp(argv[i], "-chrome") == 0 && i + 1 < argc) {
+            chrome_path = argv[++i];
+        } else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+            int interval = std::atoi(argv[++i]);
+            if (interval <= 0) {
+                std::cerr << "Invalid interval.\n";
+                return 1;
+            }
+            interval_ms = interval;
+        } else if (strcmp(argv[i], "-Io") == 0 && i + 1 < argc) {
+            interval_path = argv[++i];
+        } else if (strcmp(argv[i], "-lines") == 0) {
+            lines_set = true;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            stream_path = argv[++i];
+        } else if (strcmp(argv[i], "-F") == 0 && i + 1 < argc) {
+            flight_seconds = std::atof(argv[++i]);
+            if (flight_seconds <= 0) {
+                std::cerr << "Invalid flight recorder window.\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-Fo") == 0 && i + 1 < argc) {
+            flight_prefix = argv[++i];
+        } else if (strcmp(argv[i], "-Ft") == 0 && i + 1 < argc) {
+            flight_timeout = std::atof(argv[++i]);
+            if (flight_timeout <= 0) {
+                std::cerr << "Invalid snapshot timeout.\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-Fc") == 0 && i + 1 < argc) {
+            flight_threshold = argv[++i];
+        } else if (strcmp(argv[i], "-jit") == 0) {
+            jit_set = true;
+        } else if (strcmp(argv[i], "-export") == 0 && i + 1 < argc) {
+            export_path = argv[++i];
         } else {
             program_args.push_back(argv[i]);
         }
     }
 
-    if (program_args.empty()) {
-        std::cerr << "Usage: " << argv[0] << " [-time <time>] [-count <event>] [-record <event:period>] command arg1 arg2 ...\n";
+    // A recording made with -o, the event is only known from -record
+    if (!export_path.empty()) {
+        if (pprof_path.empty() && chrome_path.empty()) {
+            std::cerr << "-export requires -pprof or -chrome.\n";
+            return 1;
+        }
+        return export_stream(export_path, pprof_path, chrome_path, record_set ? record_event : "", record_set ? sample_period : 1);
+    }
+
+    if (program_args.empty() && cgroup_paths.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [-time <time>] [-count <event>] [-record <event:period>] [-regions] [-offcpu] [-mem] [-G <cgroup>] [-pprof <file>] [-chrome <file>] [-I <ms>] [-Io <file>] [-lines] [-o <file>] [-F <seconds>] [-Fo <prefix>] [-Ft <seconds>] [-Fc <name>><limit>] [-jit] command arg1 arg2 ...\n"
+                  << "       " << argv[0] << " -export <stream> [-record <event:period>] [-pprof <file>] [-chrome <file>]\n";
         return 1;
     }
 
@@ -92,6 +375,149 @@ int main(int argc, char *argv[]) {
     }
     exec_args.push_back(nullptr);
 
+    // Whole containers instead of a forked command, the command is optional there
+    if (!cgroup_paths.empty()) {
+        if (regions_set || offcpu_set || !pprof_path.empty() || !chrome_path.empty() || interval_ms || lines_set || !stream_path.empty() || flight_seconds || jit_set) {
+            std::cerr << "-regions, -offcpu, -pprof, -chrome, -I, -lines, -o, -F and -jit are not supported with -G.\n";
+            return 1;
+        }
+        if (!count_set && !record_set) {
+            std::cerr << "-G requires -count or -record.\n";
+            return 1;
+        }
+        uint64_t sample_type = DEFAULT_SAMPLE_TYPE;
+        if (mem_set) {
+            sample_type |= PERF_SAMPLE_ADDR;
+        }
+        return run_cgroups(cgroup_paths, count_event, record_event, sample_period, sample_type, exec_args, sleep_time);
+    }
+
+    // Shared memory ring for prof_region.h markers, found by the child through the environment
+    std::unique_ptr<RegionTracker> regions;
+    if (regions_set) {
+        if (!record_set) {
+            std::cerr << "-regions requires -record.\n";
+            return 1;
+        }
+        regions = std::make_unique<RegionTracker>();
+        global_profile.regions = regions.get();
+    }
+
+    // Off-CPU intervals from context switches, next to the on-CPU stacks of the sampling event
+    std::unique_ptr<OffCpuTracker> offcpu;
+    if (offcpu_set) {
+        if (!record_set) {
+            std::cerr << "-offcpu requires -record.\n";
+            return 1;
+        }
+        offcpu = std::make_unique<OffCpuTracker>();
+        global_profile.offcpu = offcpu.get();
+    }
+
+    // Data addresses of the samples, for -record page-faults, major-faults or a precise memory event
+    std::unique_ptr<MemTracker> memory;
+    if (mem_set) {
+        if (!record_set) {
+            std::cerr << "-mem requires -record.\n";
+            return 1;
+        }
+        memory = std::make_unique<MemTracker>();
+        global_profile.memory = memory.get();
+    }
+
+    // Source lines of the sampled IPs, from the .debug_line of the mapped modules
+    std::unique_ptr<SourceLineTracker> lines;
+    if (lines_set) {
+        if (!record_set) {
+            std::cerr << "-lines requires -record.\n";
+            return 1;
+        }
+        lines = std::make_unique<SourceLineTracker>();
+        global_profile.lines = lines.get();
+    }
+
+    // Symbols of JIT code from /tmp/perf-<pid>.map and jitdump files, resolved at the sample time
+    std::unique_ptr<JitSymbols> jit;
+    if (jit_set) {
+        if (!record_set) {
+            std::cerr << "-jit requires -record.\n";
+            return 1;
+        }
+        jit = std::make_unique<JitSymbols>();
+        global_profile.jit = jit.get();
+    }
+
+    // Timestamped samples and regions are streamed to the trace while draining
+    std::unique_ptr<ChromeTraceWriter> trace;
+    if (!chrome_path.empty()) {
+        if (!record_set) {
+            std::cerr << "-chrome requires -record.\n";
+            return 1;
+        }
+        trace = std::make_unique<ChromeTraceWriter>(chrome_path);
+        global_profile.trace = trace.get();
+        if (regions) {
+            regions->trace = trace.get();
+        }
+    }
+    // Every sample encoded into a compact delta/varint stream while draining
+    std::unique_ptr<SampleEncoder> stream;
+    if (!stream_path.empty()) {
+        if (!record_set) {
+            std::cerr << "-o requires -record.\n";
+            return 1;
+        }
+        stream = std::make_unique<SampleEncoder>(stream_path);
+        global_profile.stream = stream.get();
+    }
+    if (!pprof_path.empty() && !record_set) {
+        std::cerr << "-pprof requires -record.\n";
+        return 1;
+    }
+
+    // In interval mode the -count event leads a group with the usual derived-metric events
+    std::vector<std::string> interval_names;
+    if (interval_ms) {
+        for (const std::string &name : {count_event, std::string("task-clock"), std::string("cycles"), std::string("instructions"),
+                                        std::string("cache-references"), std::string("cache-misses")}) {
+            if (!name.empty() && std::find(interval_names.begin(), interval_names.end(), name) == interval_names.end()) {
+                interval_names.push_back(name);
+            }
+        }
+    }
+
+    // Overwrite buffers instead of draining, only read when a snapshot is triggered
+    if (flight_seconds) {
+        if (!record_set) {
+            std::cerr << "-F requires -record.\n";
+            return 1;
+        }
+        if (regions || offcpu || memory || trace || lines || stream || jit || !pprof_path.empty()) {
+            std::cerr << "-regions, -offcpu, -mem, -chrome, -lines, -o, -jit and -pprof need every sample, they are not supported with -F.\n";
+            return 1;
+        }
+        if (!flight_threshold.empty() && !interval_ms) {
+            std::cerr << "-Fc requires -I.\n";
+            return 1;
+        }
+        if (!flight_threshold.empty()) {
+            if (!FlightRecorder::parse_threshold(flight_threshold, threshold_name, threshold_limit)) {
+                std::cerr << "Invalid threshold, expected <name>><limit>.\n";
+                return 1;
+            }
+            // An interval event or derived value, events the machine lacks are only known once opened
+            if (std::find(interval_names.begin(), interval_names.end(), threshold_name) == interval_names.end()
+                && threshold_name != "ipc" && threshold_name != "cache_miss_rate") {
+                std::cerr << "Unknown threshold counter " << threshold_name << ".\n";
+                return 1;
+            }
+        }
+        signal(SIGUSR2, request_snapshot);
+    } else if (flight_timeout || !flight_threshold.empty()) {
+        std::cerr << "-Ft and -Fc require -F.\n";
+        return 1;
+    }
+
     int pipefd[2];
     if (pipe(pipefd) == -1) {
         error_and_exit("pipe");
@@ -112,23 +538,57 @@ int main(int argc, char *argv[]) {
         }
         close(pipefd[0]);
 
+        if (regions) {
+            setenv(PROF_REGIONS_ENV, regions->shm_name().c_str(), 1);
+        }
+
         // Executing the program
         execvp(exec_args[0], exec_args.data());
         error_and_exit("execvp");
     } else {  // Parent process
         close(pipefd[0]);
 
-        PerfEvent *count_event_perf = nullptr;
-        PerfEvent *record_event_perf = nullptr;
-        std::unordered_map<int, PerfEvent*> events_map;
+        std::unique_ptr<PerfEvent> count_event_perf;
+        EventMap events_map;
 
-        if (count_set) {
-            count_event_perf = new PerfEvent(count_event, false, pid);
+        std::unique_ptr<CounterGroup> interval_group;
+        std::unique_ptr<IntervalRecorder> interval;
+        if (interval_ms) {
+            interval_group = std::make_unique<CounterGroup>(interval_names, pid);
+            interval = std::make_unique<IntervalRecorder>(*interval_group, interval_ms, interval_path);
+        } else if (count_set) {
+            count_event_perf = std::make_unique<PerfEvent>(count_event, false, pid);
         }
 
-        if (record_set) {
-            record_event_perf = new PerfEvent(record_event, true, pid, sample_period);
-            events_map[record_event_perf->fd] = record_event_perf;
+        std::unique_ptr<FlightRecorder> flight;
+        if (flight_seconds) {
+            flight = std::make_unique<FlightRecorder>(record_event, pid, sample_period, DEFAULT_SAMPLE_TYPE | PERF_SAMPLE_TIME,
+                                                      flight_seconds, flight_prefix);
+            flight->set_timeout(flight_timeout);
+            if (!threshold_name.empty()) {
+                flight->set_threshold(threshold_name, threshold_limit);
+            }
+        } else if (record_set) {
+            uint64_t sample_type = DEFAULT_SAMPLE_TYPE;
+            if (regions || trace || stream || jit) {
+                sample_type |= PERF_SAMPLE_TIME;
+            }
+            if (offcpu) {
+                sample_type |= PERF_SAMPLE_CALLCHAIN;
+            }
+            if (memory) {
+                sample_type |= PERF_SAMPLE_ADDR;
+            }
+            for (int cpu : online_cpus()) {
+                auto record_event_perf = PerfEvent::task(record_event, pid, cpu, sample_period, sample_type, offcpu_set);
+                if (memory && record_event_perf->fd != -1 && events_map.empty()) {
+                    std::cout << "Sampling " << record_event << " with precise_ip " << record_event_perf->precise_ip << "\n";
+                }
+                if (record_event_perf->fd != -1) {
+                    int record_fd = record_event_perf->fd;
+                    events_map[record_fd] = std::move(record_event_perf);
+                }
+            }
         }
 
         auto begin = std::chrono::steady_clock::now();
@@ -137,6 +597,10 @@ int main(int argc, char *argv[]) {
             sleep(sleep_time);
         }
 
+        if (interval) {
+            interval->start();
+        }
+
         // Sending signal to the child
         if (write(pipefd[1], "", 1) != 1) {
             error_and_exit("write");
@@ -144,7 +608,10 @@ int main(int argc, char *argv[]) {
         close(pipefd[1]);
 
 
-        while (!events_map.empty()) {
+        // Without sampling buffers to hang up, a pidfd tells when the child exits; without one waitpid is checked on every wakeup
+        bool child_running = interval || flight;
+        int child_fd = child_running ? syscall(SYS_pidfd_open, pid, 0) : -1;
+        while (!events_map.empty() || child_running) {
             std::vector<struct pollfd> poll_fds(events_map.size());
             int i = 0;
             for (const auto& pair : events_map) {
@@ -152,27 +619,77 @@ int main(int argc, char *argv[]) {
                 poll_fds[i].events = POLLIN;
                 ++i;
             }
+            if (child_running && interval) {
+                poll_fds.push_back({interval->timer_fd, POLLIN, 0});
+            }
+            if (child_running && child_fd != -1) {
+                poll_fds.push_back({child_fd, POLLIN, 0});
+            }
+            if (child_running && flight) {
+                flight->add_poll_fds(poll_fds);
+            }
 
 
 	    // Poll for events
-            int poll_result = poll(poll_fds.data(), poll_fds.size(), -1);
-            if (poll_result == -1) {
+            int poll_result = poll(poll_fds.data(), poll_fds.size(), flight ? FLIGHT_POLL_MS : -1);
+            if (poll_result == -1 && errno != EINTR) {
                 error_and_exit("poll");
             }
+            if (poll_result == -1) {
+                poll_fds.clear(); // SIGUSR2, revents are not set
+            }
 
+            // Region events have to be known before the samples that follow them
+            if (regions) {
+                regions->drain();
+            }
+
+            bool child_exited = false;
             for (const auto& pfd : poll_fds) {
-                if (pfd.revents & POLLIN) {
-                    if (events_map[pfd.fd] != nullptr) {
-			events_map[pfd.fd]->read_samples(events_map, global_histogram, global_mmap_records, global_ip_histogram);
+                if (child_running && interval && pfd.fd == interval->timer_fd) {
+                    if (pfd.revents & POLLIN) {
+                        interval->on_timer();
+                        if (flight) {
+                            flight->on_interval(*interval);
+                        }
+                    }
+                    continue;
+                }
+                if (child_running && pfd.fd == child_fd) {
+                    if (pfd.revents & POLLIN) {
+                        child_exited = true;
+                    }
+                    continue;
+                }
+                if (pfd.revents & (POLLIN | POLLHUP)) {
+                    auto it = events_map.find(pfd.fd);
+                    if (it != events_map.end()) {
+			it->second->read_samples(events_map, global_profile);
                     }
                 }
                 if (pfd.revents & POLLHUP) {
-                    close(pfd.fd);
-		    delete events_map[pfd.fd];
                     events_map.erase(pfd.fd);
                 }
             }
 
+            if (flight) {
+                flight->drain_sideband();
+                if (snapshot_requested) {
+                    snapshot_requested = 0;
+                    flight->snapshot("SIGUSR2");
+                }
+                flight->check_timeout();
+            }
+
+            if (child_running && child_fd == -1 && waitpid(pid, nullptr, WNOHANG) == pid) {
+                child_exited = true;
+            }
+            if (child_exited) {
+                if (interval) {
+                    interval->finish();
+                }
+                child_running = false;
+            }
         }
 
         auto end = std::chrono::steady_clock::now();
@@ -181,19 +698,49 @@ int main(int argc, char *argv[]) {
         std::cout << "Elapsed time: " << elapsed_ms.count() << " milliseconds\n";
 
         // Read final counts and clean up
-        if (count_set) {
-            ioctl(count_event_perf->fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (count_event_perf) {
+            count_event_perf->disable();
             count_event_perf->read_count();
-            delete count_event_perf;
+        }
+        uint64_t interval_count;
+        if (interval && count_set && interval->total(count_event, interval_count)) {
+            std::cout << "Event count (" << count_event << ") for PID " << pid << ": " << interval_count << "\n\n";
         }
 
         for (auto& pair : events_map) {
-            ioctl(pair.second->fd, PERF_EVENT_IOC_DISABLE, 0);
-            delete pair.second;
+            pair.second->disable();
+        }
+        if (child_fd != -1) {
+            close(child_fd);
         }
     }
 
     print_global_histogram();
+    if (regions) {
+        regions->print(record_event, sample_period);
+    }
+    if (offcpu) {
+        offcpu->print(global_profile.mmap_records);
+    }
+    if (memory) {
+        memory->print();
+    }
+    if (lines) {
+        lines->print(global_profile.ip_histogram);
+    }
+    if (jit) {
+        jit->print(global_profile.samples);
+    }
+    if (stream) {
+        stream->flush();
+        std::cout << "Sample stream: " << stream->samples << " samples, " << stream->bytes() << " bytes ("
+                  << (stream->samples ? (double)stream->bytes() / stream->samples : 0) << " bytes/sample, raw records "
+                  << (stream->samples ? (double)stream->raw_bytes / stream->samples : 0) << ")\n";
+    }
+    if (!pprof_path.empty()) {
+        export_pprof(pprof_path, record_event, sample_period, offcpu.get());
+    }
+    print_profiler_stats();
 
     return 0;
 }
@@ -0,0 +1,456 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <chrono>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "utils.h"
+#include "PerfEvent.h"
+#include "SampleStream.h"
+
+// Self-benchmark of perf_monitor: runs every synthetic workload from
+// bench_workload without profiling and under perf_monitor at several
+// sample periods, and reports the cost of the sampling path. It also
+// measures the latency of reading a self-monitoring PerfEvent and the size
+// and speed of the compact sample stream.
+
+struct RunResult {
+    double wall_ms = 0;
+    uint64_t samples = 0;
+    uint64_t lost = 0;
+    double profiler_cpu_ms = 0;
+};
+
+// Directory of this binary, perf_monitor and bench_workload are built next to it
+std::string binary_dir() {
+    char path[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len == -1) {
+        error_and_exit("readlink");
+    }
+    path[len] = '\0';
+    std::string dir(path);
+    return dir.substr(0, dir.rfind('/'));
+}
+
+// Runs the command with stdout captured and returns its wall time and output
+double run_command(std::vector<std::string> args, std::string &output) {
+    std::vector<char*> exec_args;
+    for (auto &arg : args) {
+        exec_args.push_back(&arg[0]);
+    }
+    exec_args.push_back(nullptr);
+
+    int pipefd[2];
+    if (pipe(pipefd) == -1) {
+        error_and_exit("pipe");
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        error_and_exit("fork");
+    }
+
+    if (pid == 0) {  // Child process
+        close(pipefd[0]);
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[1]);
+        execv(exec_args[0], exec_args.data());
+        error_and_exit("execv");
+    }
+
+    close(pipefd[1]);
+    output.clear();
+    char buffer[65536];
+    ssize_t n;
+    while ((n = read(pipefd[0], buffer, sizeof(buffer))) > 0) {
+        output.append(buffer, n);
+    }
+    close(pipefd[0]);
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        error_and_exit("waitpid");
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::cerr << "Command " << args[0] << " failed.\n";
+        exit(EXIT_FAILURE);
+    }
+
+    return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+// Picks the statistics printed by print_profiler_stats in perf_monitor
+void parse_stats(const std::string &output, RunResult &result) {
+    std::istringstream stream(output);
+    std::string line;
+    while (std::getline(stream, line)) {
+        if (line.rfind("Samples drained: ", 0) == 0) {
+            result.samples = std::stoull(line.substr(17));
+        } else if (line.rfind("Lost samples: ", 0) == 0) {
+            result.lost = std::stoull(line.substr(14));
+        } else if (line.rfind("Profiler CPU time: ", 0) == 0) {
+            result.profiler_cpu_ms = std::stod(line.substr(19));
+        }
+    }
+}
+
+// Best of several runs, to filter out noise from the rest of the machine
+RunResult run_best(const std::vector<std::string> &args, int repeats) {
+    RunResult best;
+    std::string output;
+    for (int i = 0; i < repeats; ++i) {
+        RunResult result;
+        result.wall_ms = run_command(args, output);
+        parse_stats(output, result);
+        if (i == 0 || result.wall_ms < best.wall_ms) {
+            best = result;
+        }
+    }
+    return best;
+}
+
+std::vector<std::string> split(const std::string &list) {
+    std::vector<std::string> items;
+    std::istringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        items.push_back(item);
+    }
+    return items;
+}
+
+// Nanoseconds per call of read, best of several rounds
+template <typename Read>
+double read_latency_ns(Read read, int iterations) {
+    double best = 0;
+    for (int round = 0; round < 5; ++round) {
+        auto begin = std::chrono::steady_clock::now();
+        uint64_t sum = 0;
+        for (int i = 0; i < iterations; ++i) {
+            sum += read();
+        }
+        auto end = std::chrono::steady_clock::now();
+        asm volatile("" :: "r"(sum));
+        double ns = std::chrono::duration<double, std::nano>(end - begin).count() / iterations;
+        if (round == 0 || ns < best) {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+// Userspace (rdpmc) and read() paths of PerfEvent::read_value on the calling thread
+void bench_read_latency(const std::vector<std::string> &events) {
+    const int iterations = 100000;
+
+    std::cout << "\nSelf-monitoring read latency, " << iterations << " reads\n\n";
+    std::cout << std::left << std::setw(14) << "event" << std::right
+              << std::setw(8) << "rdpmc"
+              << std::setw(16) << "read_value ns"
+              << std::setw(16) << "read() ns" << "\n";
+    std::cout << std::fixed << std::setprecision(1);
+
+    for (const auto &event : events) {
+        auto counter = PerfEvent::self(event);
+        if (counter == nullptr || counter->fd == -1) {
+            std::cout << std::left << std::setw(14) << event << std::right << std::setw(8) << "-"
+                      << std::setw(16) << "unavailable" << std::setw(16) << "unavailable" << "\n";
+            continue;
+        }
+
+        double fast_ns = read_latency_ns([&]() { return counter->read_value(); }, iterations);
+        double syscall_ns = read_latency_ns([&]() { return counter->read_value_syscall(); }, iterations);
+
+        std::cout << std::left << std::setw(14) << event << std::right
+                  << std::setw(8) << (counter->rdpmc_available() ? "yes" : "no")
+                  << std::setw(16) << fast_ns
+                  << std::setw(16) << syscall_ns << "\n";
+    }
+}
+
+// Synthetic samples shaped like a real profile: a few threads spinning in hot
+// code at a fixed period, with callchains from a small set of stacks
+struct SyntheticSamples {
+    std::vector<StreamSample> samples;
+    std::string raw; // The same samples as perf records, IP | TID | TIME (| CALLCHAIN)
+    std::vector<uint32_t> raw_sizes;
+};
+
+SyntheticSamples make_samples(size_t count, bool callchains) {
+    const int threads = 8, stacks = 200, depth = 12;
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    auto random = [&state]() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+
+    std::vector<Stack> stack_pool(stacks);
+    for (auto &stack : stack_pool) {
+        for (int frame = 0; frame < depth; ++frame) {
+            stack.push_back(0x555555554000ULL + random() % 0x40000);
+        }
+    }
+
+    SyntheticSamples synthetic;
+    std::vector<uint64_t> times(threads, 1000000000ULL);
+    for (size_t i = 0; i < count; ++i) {
+        StreamSample sample;
+        int thread = random() % threads;
+        sample.pid = 4242;
+        sample.tid = 4242 + thread;
+        times[thread] += 100000 + random() % 2000; // 10 kHz with jitter
+        sample.time = times[thread];
+        if (callchains) {
+            sample.callchain = stack_pool[random() % stacks];
+            sample.ip = sample.callchain[0];
+        } else {
+            sample.ip = 0x555555558000ULL + random() % 0x1000;
+        }
+
+        uint64_t fields[4 + depth + 1];
+        size_t n = 0;
+        fields[n++] = sample.ip;
+        fields[n++] = (uint64_t)sample.tid << 32 | sample.pid;
+        fields[n++] = sample.time;
+        if (callchains) {
+            fields[n++] = sample.callchain.size();
+            for (uint64_t frame : sample.callchain) {
+                fields[n++] = frame;
+            }
+        }
+        struct perf_event_header header = {PERF_RECORD_SAMPLE, 0, (uint16_t)(sizeof(header) + n * sizeof(uint64_t))};
+        synthetic.raw.append((const char *)&header, sizeof(header));
+        synthetic.raw.append((const char *)fields, n * sizeof(uint64_t));
+        synthetic.raw_sizes.push_back(header.size);
+        synthetic.samples.push_back(std::move(sample));
+    }
+    return synthetic;
+}
+
+// Best of several rounds, in nanoseconds per sample
+template <typename Run>
+double per_sample_ns(Run run, size_t count) {
+    double best = 0;
+    for (int round = 0; round < 5; ++round) {
+        auto begin = std::chrono::steady_clock::now();
+        run();
+        auto end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - begin).count() / count;
+        if (round == 0 || ns < best) {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+// Compact SampleEncoder stream against copying and parsing the raw perf records
+void bench_sample_stream() {
+    const size_t count = 1000000;
+
+    std::cout << "\nSample stream encoding, " << count << " synthetic samples\n\n";
+    std::cout << std::left << std::setw(10) << "format" << std::setw(11) << "callchain" << std::right
+              << std::setw(14) << "bytes/sample"
+              << std::setw(14) << "encode ns"
+              << std::setw(14) << "decode ns"
+              << std::setw(16) << "encode MB/s" << "\n";
+    std::cout << std::fixed << std::setprecision(1);
+
+    for (bool callchains : {false, true}) {
+        SyntheticSamples synthetic = make_samples(count, callchains);
+        const char *with = callchains ? "yes" : "no";
+        double raw_mb = synthetic.raw.size() / 1e6;
+
+        // Raw: copy every record out, parse the fields back
+        std::string copy;
+        double raw_encode = per_sample_ns([&]() {
+            copy.clear();
+            copy.reserve(synthetic.raw.size());
+            size_t offset = 0;
+            for (uint32_t size : synthetic.raw_sizes) {
+                copy.append(synthetic.raw, offset, size);
+                offset += size;
+            }
+        }, count);
+        StreamSample parsed;
+        double raw_decode = per_sample_ns([&]() {
+            const char *record = copy.data(), *end = copy.data() + copy.size();
+            while (record < end) {
+                struct perf_event_header header;
+                memcpy(&header, record, sizeof(header));
+                const char *field = record + sizeof(header);
+                uint64_t tid_field;
+                memcpy(&parsed.ip, field, 8);
+                memcpy(&tid_field, field + 8, 8);
+                memcpy(&parsed.time, field + 16, 8);
+                parsed.pid = tid_field;
+                parsed.tid = tid_field >> 32;
+                if (callchains) {
+                    uint64_t nr;
+                    memcpy(&nr, field + 24, 8);
+                    parsed.callchain.resize(nr);
+                    memcpy(parsed.callchain.data(), field + 32, nr * 8);
+                }
+                record += header.size;
+            }
+        }, count);
+
+        // Compact: the encoder the drain loop uses, a fresh dictionary every round
+        std::unique_ptr<SampleEncoder> encoder;
+        double compact_encode = per_sample_ns([&]() {
+            encoder = std::make_unique<SampleEncoder>();
+            for (size_t i = 0; i < count; ++i) {
+                const StreamSample &sample = synthetic.samples[i];
+                encoder->add(sample.pid, sample.tid, sample.time, sample.ip, sample.callchain, synthetic.raw_sizes[i]);
+            }
+        }, count);
+        size_t decoded = 0;
+        bool matches = true;
+        double compact_decode = per_sample_ns([&]() {
+            SampleDecoder decoder(encoder->data().data(), encoder->data().size());
+            StreamSample sample;
+            decoded = 0;
+            while (decoder.next(sample)) {
+                const StreamSample &expected = synthetic.samples[decoded++];
+                matches &= sample.ip == expected.ip && sample.time == expected.time && sample.tid == expected.tid;
+            }
+        }, count);
+
+        std::cout << std::left << std::setw(10) << "raw" << std::setw(11) << with << std::right
+                  << std::setw(14) << (double)synthetic.raw.size() / count
+                  << std::setw(14) << raw_encode
+                  << std::setw(14) << raw_decode
+                  << std::setw(16) << raw_mb / (raw_encode * count / 1e9) << "\n";
+        std::cout << std::left << std::setw(10) << "compact" << std::setw(11) << with << std::right
+                  << std::setw(14) << (double)encoder->bytes() / count
+                  << std::setw(14) << compact_encode
+                  << std::setw(14) << compact_decode
+                  << std::setw(16) << raw_mb / (compact_encode * count / 1e9) << "\n";
+        if (decoded != count || !matches) {
+            std::cout << "Round trip mismatch: " << decoded << " of " << count << " samples decoded\n";
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    std::string event = "cpu-clock";
+    std::vector<std::string> workloads = {"loop", "fork", "mmap", "threads"};
+    std::vector<std::string> periods = {"1000000", "100000", "20000"};
+    std::string scale = "1";
+    std::string interval_ms = "10";
+    int repeats = 3;
+    bool latency_only = false;
+    bool stream_only = false;
+    std::vector<std::string> latency_events = {"cycles", "instructions", "task-clock", "cpu-clock"};
+
+    // Parse command line arguments
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            event = argv[++i];
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            workloads = split(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            periods = split(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            scale = argv[++i];
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            repeats = std::atoi(argv[++i]);
+            if (repeats <= 0) {
+                std::cerr << "Invalid repeat count.\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            interval_ms = argv[++i];
+        } else if (strcmp(argv[i], "-latency") == 0) {
+            latency_only = true;
+        } else if (strcmp(argv[i], "-stream") == 0) {
+            stream_only = true;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [-e <event>] [-w <workload,...>] [-p <period,...>] [-s <scale>] [-r <repeats>] [-i <interval ms>] [-latency] [-stream]\n";
+            return 1;
+        }
+    }
+
+    if (latency_only) {
+        bench_read_latency(latency_events);
+        return 0;
+    }
+    if (stream_only) {
+        bench_sample_stream();
+        return 0;
+    }
+
+    std::string dir = binary_dir();
+    std::string monitor = dir + "/perf_monitor";
+    std::string workload_bin = dir + "/bench_workload";
+
+    std::cout << "Event: " << event << ", best of " << repeats << " runs\n\n";
+    std::cout << std::left << std::setw(10) << "workload" << std::right
+              << std::setw(10) << "period"
+              << std::setw(12) << "base ms"
+              << std::setw(12) << "profiled ms"
+              << std::setw(10) << "slowdown"
+              << std::setw(10) << "samples"
+              << std::setw(14) << "samples/s"
+              << std::setw(8) << "lost"
+              << std::setw(8) << "lost %"
+              << std::setw(14) << "profiler ms" << "\n";
+    std::cout << std::fixed << std::setprecision(1);
+    bool any_lost = false;
+
+    for (const auto &workload : workloads) {
+        RunResult base = run_best({workload_bin, workload, scale}, repeats);
+
+        // Sampling at every period, then interval counting (-I) which should cost almost nothing
+        std::vector<std::pair<std::string, std::vector<std::string>>> configs;
+        for (const auto &period : periods) {
+            configs.push_back({period, {"-record", event + ":" + period}});
+        }
+        if (!interval_ms.empty()) {
+            configs.push_back({"I" + interval_ms + "ms", {"-I", interval_ms, "-Io", "/dev/null"}});
+        }
+
+        for (const auto &[label, monitor_args] : configs) {
+            std::vector<std::string> args = {monitor};
+            args.insert(args.end(), monitor_args.begin(), monitor_args.end());
+            args.insert(args.end(), {workload_bin, workload, scale});
+            RunResult profiled = run_best(args, repeats);
+
+            double slowdown = profiled.wall_ms / base.wall_ms;
+            double drain_rate = profiled.samples / (profiled.wall_ms / 1000.0);
+            double lost_percent = profiled.lost ? 100.0 * profiled.lost / (profiled.samples + profiled.lost) : 0;
+            any_lost |= profiled.lost != 0;
+
+            std::cout << std::left << std::setw(10) << workload << std::right
+                      << std::setw(10) << label
+                      << std::setw(12) << base.wall_ms
+                      << std::setw(12) << profiled.wall_ms
+                      << std::setw(9) << std::setprecision(3) << slowdown << (profiled.lost ? "!" : "x") << std::setprecision(1)
+                      << std::setw(10) << profiled.samples
+                      << std::setw(14) << drain_rate
+                      << std::setw(8) << profiled.lost
+                      << std::setw(8) << lost_percent
+                      << std::setw(14) << profiled.profiler_cpu_ms << "\n";
+        }
+    }
+    if (any_lost) {
+        std::cout << "\n! Records were lost to a full buffer: the slowdown and profiler time leave out the cost of draining them.\n";
+    }
+
+    bench_read_latency(latency_events);
+    bench_sample_stream();
+
+    return 0;
+}
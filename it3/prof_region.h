@@ -0,0 +1,160 @@
+#ifndef PROF_REGION_H
+#define PROF_REGION_H
+
+// Region markers for attributing perf_monitor samples to application phases.
+//
+// Header-only, include it in the profiled program and mark a scope with
+//     PROF_REGION("execute");
+// The enter/exit timestamps go to a shared memory ring created by
+// `perf_monitor -regions`, whose name is passed in PROF_REGIONS_SHM. Recording
+// an event is a vDSO clock read and an atomic increment, no syscalls. Without
+// perf_monitor the markers do nothing.
+//
+// The ring holds PROF_REGIONS_CAPACITY entries. Two writers get the same slot
+// only when one of them is stalled between claiming its index and publishing
+// the entry while the others record a whole ring of events; the entry can then
+// mix the fields of both. The monitor drops entries that change while it reads
+// them, but cannot detect such a mix once both writers are done.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define PROF_REGIONS_ENV "PROF_REGIONS_SHM"
+#define PROF_REGIONS_MAGIC 0x70726f667265676eULL // "profregn"
+#define PROF_REGIONS_CAPACITY (1 << 16)           // Ring entries, power of two
+#define PROF_REGIONS_MAX_NAMES 256
+#define PROF_REGIONS_NAME_LEN 48
+
+namespace prof {
+
+enum RegionKind : uint32_t { REGION_ENTER = 1, REGION_EXIT = 2 };
+
+struct RegionEntry {
+    std::atomic<uint64_t> seq; // Ring index + 1 once the entry is complete
+    uint64_t time;             // CLOCK_MONOTONIC, same clock as the samples
+    uint32_t pid;
+    uint32_t tid;
+    uint16_t region;
+    uint16_t kind;
+};
+
+struct RegionShm {
+    uint64_t magic;
+    std::atomic<uint64_t> head;       // Next ring index to be written
+    std::atomic<uint32_t> name_count; // Registered region names
+    char names[PROF_REGIONS_MAX_NAMES][PROF_REGIONS_NAME_LEN];
+    std::atomic<uint32_t> name_ready[PROF_REGIONS_MAX_NAMES];
+    RegionEntry entries[PROF_REGIONS_CAPACITY];
+};
+
+// Ids of the calling thread, read once per thread and again in a forked child
+struct ThreadIds {
+    uint32_t pid = 0;
+    uint32_t tid = 0;
+};
+
+inline ThreadIds &thread_ids() {
+    static thread_local ThreadIds ids;
+    if (ids.tid == 0) {
+        ids.pid = getpid();
+        ids.tid = syscall(SYS_gettid);
+    }
+    return ids;
+}
+
+// Maps the ring once per process, nullptr when not running under perf_monitor
+inline RegionShm *region_shm() {
+    static RegionShm *shm = []() -> RegionShm * {
+        const char *name = getenv(PROF_REGIONS_ENV);
+        if (name == nullptr) {
+            return nullptr;
+        }
+        int fd = shm_open(name, O_RDWR, 0);
+        if (fd == -1) {
+            return nullptr;
+        }
+        void *addr = mmap(NULL, sizeof(RegionShm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED || ((RegionShm *)addr)->magic != PROF_REGIONS_MAGIC) {
+            return nullptr;
+        }
+        // Only the forking thread exists in the child
+        pthread_atfork(nullptr, nullptr, []() { thread_ids() = ThreadIds(); });
+        return (RegionShm *)addr;
+    }();
+    return shm;
+}
+
+inline int register_region(const char *name) {
+    RegionShm *shm = region_shm();
+    if (shm == nullptr) {
+        return -1;
+    }
+
+    uint32_t count = shm->name_count.load(std::memory_order_acquire);
+    for (uint32_t i = 0; i < count && i < PROF_REGIONS_MAX_NAMES; ++i) {
+        if (shm->name_ready[i].load(std::memory_order_acquire) && strncmp(shm->names[i], name, PROF_REGIONS_NAME_LEN - 1) == 0) {
+            return i;
+        }
+    }
+
+    uint32_t id = shm->name_count.fetch_add(1);
+    if (id >= PROF_REGIONS_MAX_NAMES) {
+        return -1;
+    }
+    strncpy(shm->names[id], name, PROF_REGIONS_NAME_LEN - 1);
+    shm->name_ready[id].store(1, std::memory_order_release);
+    return id;
+}
+
+inline void record_region(int region, RegionKind kind) {
+    RegionShm *shm = region_shm();
+    if (shm == nullptr || region < 0) {
+        return;
+    }
+
+    const ThreadIds &ids = thread_ids();
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    uint64_t index = shm->head.fetch_add(1, std::memory_order_relaxed);
+    RegionEntry &entry = shm->entries[index & (PROF_REGIONS_CAPACITY - 1)];
+    // Invalid while written, so that a monitor still reading the previous entry here notices
+    entry.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    entry.time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    entry.pid = ids.pid;
+    entry.tid = ids.tid;
+    entry.region = region;
+    entry.kind = kind;
+    entry.seq.store(index + 1, std::memory_order_release);
+}
+
+class Region {
+public:
+    explicit Region(int region) : region(region) { record_region(region, REGION_ENTER); }
+    ~Region() { record_region(region, REGION_EXIT); }
+    Region(const Region &) = delete;
+    Region &operator=(const Region &) = delete;
+
+private:
+    int region;
+};
+
+} // namespace prof
+
+#define PROF_REGION_CONCAT2(a, b) a##b
+#define PROF_REGION_CONCAT(a, b) PROF_REGION_CONCAT2(a, b)
+#define PROF_REGION(name)                                                              \
+    static const int PROF_REGION_CONCAT(prof_region_id_, __LINE__) = prof::register_region(name); \
+    prof::Region PROF_REGION_CONCAT(prof_region_, __LINE__)(PROF_REGION_CONCAT(prof_region_id_, __LINE__))
+
+#endif // PROF_REGION_H
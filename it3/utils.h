@@ -10,6 +10,7 @@
 #include <asm/unistd.h>
 
 #define BUFFER_SIZE (20 * 1024) // Mmap buffer size 
+#define TASK_BUFFER_SIZE ((1 + 64) * 4096) // Per-CPU buffer shared by every thread of the task on that CPU
 
 inline void error_and_exit(const std::string &msg) {
     perror(msg.c_str());